@@ -0,0 +1,127 @@
+// Memory admission control: keeps the tests running at once inside a byte budget.
+//
+// Every worker holds a full residue of 2^p - 1 plus the temporaries of whatever squares it, so
+// with many threads and large p the sum can pass what the machine (or the container) has and
+// the run ends up swapping. Before a big step a worker reserves its estimated peak and gives
+// it back afterwards; a reservation that doesn't fit waits until enough is returned. One
+// reservation is always let through when nothing else is held, so a single test bigger than
+// the budget still runs, alone.
+//
+// The budget comes from -m, otherwise from the cgroup memory limit (v2, then v1), otherwise
+// from physical memory, less ADMISSION_HEADROOM_PERCENT for everything the estimates miss.
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define ADMISSION_HEADROOM_PERCENT 10   // of the limit left to stacks, buffers and estimate error
+#define ADMISSION_CGROUP_V2 "/sys/fs/cgroup/memory.max"
+#define ADMISSION_CGROUP_V1 "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    size_t budget;
+    size_t reserved;        // bytes held by running steps
+    int waiting;            // workers blocked on a reservation
+} admission_t;
+
+// A limit file holding a byte count, or "max"; 0 when missing or unlimited
+static inline size_t admission_read_limit(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    unsigned long long limit = 0;
+    if (fscanf(file, "%llu", &limit) != 1)
+        limit = 0;
+    fclose(file);
+    // cgroup v1 reports "no limit" as a huge page-rounded number
+    if (limit >= (unsigned long long)SIZE_MAX / 2)
+        limit = 0;
+    return (size_t)limit;
+}
+
+// Bytes the process may use: the cgroup limit or physical memory, whichever is lower.
+// *source says which one it was.
+static inline size_t admission_system_limit(const char** source) {
+    size_t physical = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+    size_t cgroup = admission_read_limit(ADMISSION_CGROUP_V2);
+    if (cgroup == 0)
+        cgroup = admission_read_limit(ADMISSION_CGROUP_V1);
+    if (cgroup != 0 && cgroup < physical) {
+        *source = "cgroup limit";
+        return cgroup;
+    }
+    *source = "physical memory";
+    return physical;
+}
+
+// requested is the -m budget in bytes, 0 to take it from the system
+static inline void admission_init(admission_t* admission, size_t requested, const char** source) {
+    pthread_mutex_init(&admission->lock, NULL);
+    pthread_cond_init(&admission->released, NULL);
+    if (requested != 0) {
+        admission->budget = requested;
+        *source = "-m";
+    } else {
+        size_t limit = admission_system_limit(source);
+        admission->budget = limit - limit / 100 * ADMISSION_HEADROOM_PERCENT;
+    }
+    admission->reserved = 0;
+    admission->waiting = 0;
+}
+
+static inline void admission_clear(admission_t* admission) {
+    pthread_cond_destroy(&admission->released);
+    pthread_mutex_destroy(&admission->lock);
+}
+
+// Whether count steps of bytes each could all hold their memory at once
+static inline int admission_fits(const admission_t* admission, size_t bytes, int count) {
+    return bytes <= admission->budget / (size_t)count;
+}
+
+// Wait until bytes fit in the budget (or nothing else is held) and take them
+static inline void admission_acquire(admission_t* admission, size_t bytes) {
+    pthread_mutex_lock(&admission->lock);
+    admission->waiting++;
+    while (admission->reserved != 0 && admission->reserved + bytes > admission->budget)
+        pthread_cond_wait(&admission->released, &admission->lock);
+    admission->waiting--;
+    admission->reserved += bytes;
+    pthread_mutex_unlock(&admission->lock);
+}
+
+static inline void admission_release(admission_t* admission, size_t bytes) {
+    pthread_mutex_lock(&admission->lock);
+    admission->reserved -= bytes;
+    pthread_cond_broadcast(&admission->released);
+    pthread_mutex_unlock(&admission->lock);
+}
+
+// Bytes reserved right now and workers waiting for room, for the status line
+static inline size_t admission_reserved(admission_t* admission, int* waiting) {
+    pthread_mutex_lock(&admission->lock);
+    size_t reserved = admission->reserved;
+    if (waiting != NULL)
+        *waiting = admission->waiting;
+    pthread_mutex_unlock(&admission->lock);
+    return reserved;
+}
+
+// Highest resident set size the process has reached, in bytes
+static inline double admission_peak_resident(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (double)usage.ru_maxrss * 1024;
+}
+
+#endif
@@ -0,0 +1,266 @@
+// Mid-test checkpoints for long Mersenne tests.
+//
+// A checkpoint is a small binary file, checkpoints/<p>.ckpt: a header with the exponent, the
+// kind of test and how many iterations are done, then the residue as raw limbs. A 64-bit
+// FNV-1a checksum over the header and limbs catches torn or corrupt files.
+// Files are written to a temporary name, fsync'd and renamed over the old one, so a crash
+// leaves either the previous checkpoint or the new one, never half of each.
+//
+// Tests run in chunks of iterations sized to take about a second, so the clock is checked
+// often enough to honour the save interval and to flush promptly after Ctrl-C.
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#define CHECKPOINT_DIR "checkpoints"
+#define CHECKPOINT_MAGIC 0x4b43504dU        // "MPCK"
+#define CHECKPOINT_DEFAULT_INTERVAL 300.0   // seconds between saves of one test
+#define CHECKPOINT_CHUNK_SECONDS 1.0        // aim for chunks of about this long
+
+// Kinds of test a residue can belong to
+#define CHECKPOINT_LUCAS_LEHMER 1
+#define CHECKPOINT_PRP 2            // x and d of a Gerbicz-checked PRP test, 2n limbs
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t exponent;
+    uint64_t iteration;     // iterations already applied to the residue
+    uint64_t limbs;
+    uint64_t checksum;      // FNV-1a over this header (with checksum 0) and the limbs
+} checkpoint_header_t;
+
+typedef struct {
+    double interval;        // seconds between saves
+    double last_save;
+    double chunk_start;
+    unsigned long chunk;    // iterations in the next chunk
+    unsigned long granted;  // iterations actually handed out for the current chunk
+} checkpoint_run_t;
+
+typedef struct {
+    unsigned long* exponents;   // sorted
+    size_t count;
+    size_t next;
+} checkpoint_list_t;
+
+static double checkpoint_last_saved = 0;   // monotonic time of the last successful save, 0 if none
+
+static inline double checkpoint_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t checkpoint_fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t checkpoint_checksum(checkpoint_header_t header, const mp_limb_t* limbs, mp_size_t n) {
+    header.checksum = 0;
+    uint64_t hash = checkpoint_fnv1a(0xcbf29ce484222325ULL, &header, sizeof(header));
+    return checkpoint_fnv1a(hash, limbs, n * sizeof(mp_limb_t));
+}
+
+static inline void checkpoint_path(char* path, size_t size, unsigned long p) {
+    snprintf(path, size, CHECKPOINT_DIR "/%lu.ckpt", p);
+}
+
+// Atomically replace the checkpoint for p. Returns 0 on success, -1 (after perror) on failure.
+static inline int checkpoint_save(unsigned long p, int kind, unsigned long iteration, const mp_limb_t* limbs, mp_size_t n) {
+    char path[256], tmp_path[272];
+    checkpoint_path(path, sizeof(path), p);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if (mkdir(CHECKPOINT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create checkpoint directory");
+        return -1;
+    }
+
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.kind = (uint32_t)kind;
+    header.exponent = p;
+    header.iteration = iteration;
+    header.limbs = (uint64_t)n;
+    header.checksum = checkpoint_checksum(header, limbs, n);
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror("Failed to open checkpoint file");
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(limbs, sizeof(mp_limb_t), n, file) == (size_t)n
+          && fflush(file) == 0
+          && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        perror("Failed to write checkpoint file");
+        unlink(tmp_path);
+        return -1;
+    }
+    double now = checkpoint_now();
+    __atomic_store(&checkpoint_last_saved, &now, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Seconds since any thread last saved a checkpoint, -1 if none has been saved this run
+static inline double checkpoint_age(void) {
+    double saved;
+    __atomic_load(&checkpoint_last_saved, &saved, __ATOMIC_RELAXED);
+    return saved == 0 ? -1 : checkpoint_now() - saved;
+}
+
+// Kind of test the checkpoint for p belongs to, 0 when there is none or its header is unreadable
+static inline int checkpoint_kind(unsigned long p) {
+    char path[256];
+    checkpoint_path(path, sizeof(path), p);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+    checkpoint_header_t header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == CHECKPOINT_MAGIC && header.exponent == p;
+    fclose(file);
+    return ok ? (int)header.kind : 0;
+}
+
+// Load the checkpoint for p into limbs (n limbs). Returns 1 when a valid checkpoint of this
+// kind and size was found, 0 otherwise. A checkpoint of another kind of test is left alone.
+static inline int checkpoint_load(unsigned long p, int kind, unsigned long* iteration, mp_limb_t* limbs, mp_size_t n) {
+    char path[256];
+    checkpoint_path(path, sizeof(path), p);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    checkpoint_header_t header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1
+          && header.magic == CHECKPOINT_MAGIC
+          && header.exponent == p;
+    if (ok && header.kind != (uint32_t)kind) {
+        fclose(file);
+        fprintf(stderr, "Ignoring checkpoint %s: it is from a %s test, not this one\n", path,
+                header.kind == CHECKPOINT_PRP ? "PRP" : header.kind == CHECKPOINT_LUCAS_LEHMER ? "Lucas-Lehmer" : "different");
+        return 0;
+    }
+    ok = ok && header.limbs == (uint64_t)n
+          && fread(limbs, sizeof(mp_limb_t), n, file) == (size_t)n
+          && header.checksum == checkpoint_checksum(header, limbs, n);
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "Ignoring damaged checkpoint %s\n", path);
+        return 0;
+    }
+    *iteration = (unsigned long)header.iteration;
+    return 1;
+}
+
+static inline void checkpoint_remove(unsigned long p) {
+    char path[256];
+    checkpoint_path(path, sizeof(path), p);
+    unlink(path);
+}
+
+static inline void checkpoint_run_init(checkpoint_run_t* run, double interval) {
+    run->interval = interval;
+    run->last_save = checkpoint_now();
+    run->chunk_start = run->last_save;
+    run->chunk = 16;
+    run->granted = 0;
+}
+
+// Iterations to run before calling checkpoint_run_due again, at most remaining
+static inline unsigned long checkpoint_run_chunk(checkpoint_run_t* run, unsigned long remaining) {
+    run->chunk_start = checkpoint_now();
+    run->granted = run->chunk < remaining ? run->chunk : remaining;
+    return run->granted;
+}
+
+// Call after each chunk: retunes the chunk length and returns 1 when a save is due
+static inline int checkpoint_run_due(checkpoint_run_t* run) {
+    double now = checkpoint_now();
+    double elapsed = now - run->chunk_start;
+    if (elapsed < CHECKPOINT_CHUNK_SECONDS / 2 && run->granted == run->chunk)
+        run->chunk *= 2;
+    else if (elapsed > CHECKPOINT_CHUNK_SECONDS * 2 && run->chunk > 1)
+        run->chunk /= 2;
+
+    if (now - run->last_save < run->interval)
+        return 0;
+    run->last_save = now;
+    return 1;
+}
+
+static inline int checkpoint_compare(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Collect the exponents that have a checkpoint of this kind waiting, so they can be resumed
+// first. Checkpoints of other kinds stay on disk for a run of that kind of test; kind 0 (a test
+// that never checkpoints) resumes nothing.
+static inline void checkpoint_list_load(checkpoint_list_t* list, int kind) {
+    list->exponents = NULL;
+    list->count = 0;
+    list->next = 0;
+
+    DIR* dir = kind != 0 ? opendir(CHECKPOINT_DIR) : NULL;
+    if (dir == NULL)
+        return;
+
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long p;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%lu.%7s", &p, suffix) != 2 || strcmp(suffix, "ckpt") != 0)
+            continue;
+        if (checkpoint_kind(p) != kind)
+            continue;
+        if (list->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            list->exponents = (unsigned long*)realloc(list->exponents, capacity * sizeof(unsigned long));
+        }
+        list->exponents[list->count++] = p;
+    }
+    closedir(dir);
+
+    qsort(list->exponents, list->count, sizeof(unsigned long), checkpoint_compare);
+}
+
+// Next exponent to resume, or 0 when all have been handed out
+static inline unsigned long checkpoint_list_next(checkpoint_list_t* list) {
+    size_t i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+    return i < list->count ? list->exponents[i] : 0;
+}
+
+// Nonzero if p is resumed from the list, so the normal stream should skip it
+static inline int checkpoint_list_contains(const checkpoint_list_t* list, unsigned long p) {
+    return list->count != 0 && bsearch(&p, list->exponents, list->count, sizeof(unsigned long), checkpoint_compare) != NULL;
+}
+
+static inline void checkpoint_list_clear(checkpoint_list_t* list) {
+    free(list->exponents);
+}
+
+#endif
@@ -0,0 +1,190 @@
+// Prime exponent stream for the Mersenne searchers.
+//
+// 2^p - 1 can only be prime when p is prime, so the workers pull their exponents
+// from here instead of walking every integer. Exponents are produced by a segmented
+// sieve that is extended one segment at a time as the search moves forward.
+//
+// A stream can be bounded by an end exponent. Once the last segment before the end is
+// sieved, exponent_stream_take() hands its exponents out largest first, so the longest
+// tests of a range start early and do not all land at the very end.
+//
+// The stream also drops exponents that are already known to give a composite 2^p - 1:
+// if p > 3, p = 3 (mod 4) and q = 2p + 1 is prime, then q divides 2^p - 1.
+
+#ifndef EXPONENT_SIEVE_H
+#define EXPONENT_SIEVE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define EXPONENT_SEGMENT_SIZE 32768
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long segment_start;     // first exponent of the next segment to sieve
+    unsigned long end;               // exponents stop before this; 0 for no end
+    unsigned long* segment;          // exponents that survived the current segment
+    size_t segment_count;
+    size_t segment_pos;
+    unsigned long* base_primes;      // odd primes up to base_limit
+    size_t base_count;
+    unsigned long base_limit;
+    unsigned long long congruence_filtered;   // read by the status thread, so atomic
+} exponent_stream_t;
+
+// Grow the odd base primes so that they cover every factor up to limit
+static inline void exponent_stream_extend_base(exponent_stream_t* stream, unsigned long limit) {
+    if (limit <= stream->base_limit)
+        return;
+
+    unsigned long new_limit = stream->base_limit ? stream->base_limit : 1024;
+    while (new_limit < limit)
+        new_limit *= 2;
+
+    char* composite = (char*)calloc(new_limit + 1, 1);
+    for (unsigned long i = 3; i * i <= new_limit; i += 2) {
+        if (!composite[i]) {
+            for (unsigned long j = i * i; j <= new_limit; j += 2 * i)
+                composite[j] = 1;
+        }
+    }
+
+    size_t count = 0;
+    for (unsigned long i = 3; i <= new_limit; i += 2)
+        if (!composite[i])
+            count++;
+
+    free(stream->base_primes);
+    stream->base_primes = (unsigned long*)malloc(count * sizeof(unsigned long));
+    stream->base_count = 0;
+    for (unsigned long i = 3; i <= new_limit; i += 2)
+        if (!composite[i])
+            stream->base_primes[stream->base_count++] = i;
+
+    stream->base_limit = new_limit;
+    free(composite);
+}
+
+static inline unsigned long exponent_isqrt(unsigned long n) {
+    if (n < 2)
+        return n;
+    unsigned long x = n, y = (x + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+// Sieve [segment_start, segment_start + EXPONENT_SEGMENT_SIZE) into stream->segment.
+// Index i stands for the exponent p = segment_start + i; it is struck out when p is
+// composite, and also when p = 3 (mod 4) and 2p + 1 is prime.
+static inline void exponent_stream_fill(exponent_stream_t* stream) {
+    unsigned long lo = stream->segment_start;
+    unsigned long hi = lo + EXPONENT_SEGMENT_SIZE;
+    if (stream->end != 0 && hi > stream->end)
+        hi = stream->end;
+    unsigned char composite_p[EXPONENT_SEGMENT_SIZE];
+    unsigned char composite_q[EXPONENT_SEGMENT_SIZE];
+
+    memset(composite_p, 0, sizeof(composite_p));
+    memset(composite_q, 0, sizeof(composite_q));
+
+    unsigned long q_max = 2 * hi + 1;
+    exponent_stream_extend_base(stream, exponent_isqrt(q_max) + 1);
+
+    for (size_t k = 0; k < stream->base_count; k++) {
+        unsigned long r = stream->base_primes[k];
+        if (r * r > q_max)
+            break;
+
+        // r | p  <=>  p = 0 (mod r)
+        if (r * r < hi) {
+            unsigned long first = r * r > lo ? r * r : ((lo + r - 1) / r) * r;
+            for (unsigned long p = first; p < hi; p += r)
+                composite_p[p - lo] = 1;
+        }
+
+        // r | 2p + 1  <=>  p = (r - 1) / 2 (mod r)
+        unsigned long residue = (r - 1) / 2;
+        unsigned long first = lo + (residue + r - lo % r) % r;
+        for (unsigned long p = first; p < hi; p += r) {
+            if (2 * p + 1 != r)
+                composite_q[p - lo] = 1;
+        }
+    }
+
+    stream->segment_count = 0;
+    stream->segment_pos = 0;
+    for (unsigned long p = lo; p < hi; p++) {
+        if (p < 2 || (p > 2 && p % 2 == 0) || composite_p[p - lo])
+            continue;
+        if (p > 3 && p % 4 == 3 && !composite_q[p - lo]) {
+            __atomic_fetch_add(&stream->congruence_filtered, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        stream->segment[stream->segment_count++] = p;
+    }
+
+    stream->segment_start = hi;
+}
+
+static inline void exponent_stream_init(exponent_stream_t* stream, unsigned long start, unsigned long end) {
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->segment_start = start;
+    stream->end = end;
+    stream->segment = (unsigned long*)malloc(EXPONENT_SEGMENT_SIZE * sizeof(unsigned long));
+    stream->segment_count = 0;
+    stream->segment_pos = 0;
+    stream->base_primes = NULL;
+    stream->base_count = 0;
+    stream->base_limit = 0;
+    stream->congruence_filtered = 0;
+}
+
+// Exponents the p = 3 (mod 4), 2p + 1 prime rule has thrown out so far
+static inline unsigned long long exponent_stream_filtered(exponent_stream_t* stream) {
+    return __atomic_load_n(&stream->congruence_filtered, __ATOMIC_RELAXED);
+}
+
+// Nonzero once every segment up to the end has been sieved
+static inline int exponent_stream_at_end(const exponent_stream_t* stream) {
+    return stream->end != 0 && stream->segment_start >= stream->end;
+}
+
+// Move up to max exponents that are still worth a full test into out and return how many.
+// Exponents come out in increasing order, except in the final segment of a bounded stream,
+// where a single exponent is handed out at a time from the top. Returns 0 once the stream
+// is used up. Safe to call from any thread.
+static inline size_t exponent_stream_take(exponent_stream_t* stream, unsigned long* out, size_t max) {
+    size_t count = 0;
+    pthread_mutex_lock(&stream->lock);
+    while (stream->segment_pos == stream->segment_count && !exponent_stream_at_end(stream))
+        exponent_stream_fill(stream);
+
+    if (exponent_stream_at_end(stream)) {
+        if (stream->segment_pos < stream->segment_count)
+            out[count++] = stream->segment[--stream->segment_count];
+    } else {
+        while (count < max && stream->segment_pos < stream->segment_count)
+            out[count++] = stream->segment[stream->segment_pos++];
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return count;
+}
+
+// Next prime exponent that is still worth a full test, or 0 when the stream is used up
+static inline unsigned long exponent_stream_next(exponent_stream_t* stream) {
+    unsigned long p = 0;
+    exponent_stream_take(stream, &p, 1);
+    return p;
+}
+
+static inline void exponent_stream_clear(exponent_stream_t* stream) {
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->segment);
+    free(stream->base_primes);
+}
+
+#endif
@@ -0,0 +1,293 @@
+// Per-thread, NUMA-local allocator for GMP, installed with mp_set_memory_functions.
+//
+// GMP passes the block size to free and realloc, so blocks need no header. Sizes up to
+// GMP_ALLOC_MAX_CLASS round up to a power of two and come from the calling thread's arena:
+// a freelist per size class, refilled by carving GMP_ALLOC_SLAB byte slabs. Slabs are
+// mmap'd, so a pinned thread's first touch (plus an mbind preference) keeps them on its own
+// NUMA node. A block freed by another thread goes onto that thread's freelist, so nothing
+// ever takes a lock on the hot path. Larger limb arrays get their own mapping, with
+// transparent huge pages asked for from 2 MB up. A freed one is parked in a small cache in
+// the freeing thread's arena and handed out again for the next request that rounds to the
+// same size, since the residues of a test come and go at a handful of fixed sizes; only
+// what falls out of the cache (oldest first) goes back to the system.
+//
+// Arena memory is kept for reuse and never handed back to the system. When a thread exits,
+// its arena goes into an idle pool and the next thread to start on the same NUMA node takes
+// it over, so short-lived threads (the radix conversion helpers) don't leave one behind each.
+// Live bytes are batched per thread and folded into the global count every
+// GMP_ALLOC_FLUSH bytes, so live and peak are accurate to about that much per thread.
+
+#ifndef GMP_ALLOC_H
+#define GMP_ALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <gmp.h>
+
+#define GMP_ALLOC_MIN_SHIFT 4               // smallest class is 16 bytes
+#define GMP_ALLOC_CLASSES 17                // 16 bytes .. 1 MB
+#define GMP_ALLOC_MAX_CLASS ((size_t)1 << (GMP_ALLOC_MIN_SHIFT + GMP_ALLOC_CLASSES - 1))
+#define GMP_ALLOC_SLAB ((size_t)4 << 20)    // arena refill size, a multiple of the huge page size
+#define GMP_ALLOC_HUGE_PAGE ((size_t)2 << 20)
+#define GMP_ALLOC_FLUSH (1L << 20)          // live bytes a thread batches before updating the total
+#define GMP_ALLOC_MPOL_PREFERRED 1
+#define GMP_ALLOC_CACHE_SLOTS 8             // large mappings an arena keeps for reuse
+#define GMP_ALLOC_CACHE_BYTES ((size_t)64 << 20) // at most this much of them per arena
+
+typedef struct gmp_arena {
+    void* free_lists[GMP_ALLOC_CLASSES];
+    char* bump;                     // unused part of the current slab
+    size_t bump_left;
+    long pending_live;              // live bytes not yet added to gmp_alloc_live
+    unsigned long long allocations;
+    int node;
+    void* cache[GMP_ALLOC_CACHE_SLOTS];     // freed large mappings, oldest first
+    size_t cache_size[GMP_ALLOC_CACHE_SLOTS];
+    int cached;
+    size_t cached_bytes;
+    struct gmp_arena* next;         // every arena, for statistics
+    struct gmp_arena* idle_next;    // arenas whose thread has exited
+} gmp_arena_t;
+
+typedef struct {
+    size_t live;                    // bytes handed to GMP and not freed
+    size_t peak;                    // most live bytes seen
+    size_t mapped;                  // bytes taken from the system
+    unsigned long long allocations;
+} gmp_alloc_stats_t;
+
+static __thread gmp_arena_t* gmp_arena = NULL;
+static gmp_arena_t* gmp_arena_list = NULL;
+static gmp_arena_t* gmp_arena_idle = NULL;
+static pthread_key_t gmp_arena_key;     // its destructor returns a thread's arena to the pool
+static pthread_once_t gmp_arena_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gmp_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static long gmp_alloc_live = 0;
+static long gmp_alloc_peak = 0;
+static size_t gmp_alloc_mapped = 0;
+
+static inline int gmp_alloc_current_node(void) {
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return (int)node;
+}
+
+// Map size bytes preferring node; huge pages when the mapping is big enough to use them
+static inline void* gmp_alloc_map(size_t size, int node) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "GMP allocator: out of memory mapping %zu bytes\n", size);
+        abort();
+    }
+    if (size >= GMP_ALLOC_HUGE_PAGE)
+        madvise(p, size, MADV_HUGEPAGE);
+    if (node >= 0 && node < 64) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, p, size, GMP_ALLOC_MPOL_PREFERRED, &mask, 64, 0);
+    }
+    __atomic_fetch_add(&gmp_alloc_mapped, size, __ATOMIC_RELAXED);
+    return p;
+}
+
+static inline void gmp_alloc_unmap(void* p, size_t size) {
+    munmap(p, size);
+    __atomic_fetch_sub(&gmp_alloc_mapped, size, __ATOMIC_RELAXED);
+}
+
+// A cached mapping of exactly size bytes (newest first), or NULL
+static inline void* gmp_alloc_cache_take(gmp_arena_t* arena, size_t size) {
+    for (int i = arena->cached - 1; i >= 0; i--) {
+        if (arena->cache_size[i] != size)
+            continue;
+        void* p = arena->cache[i];
+        arena->cached--;
+        arena->cached_bytes -= size;
+        memmove(&arena->cache[i], &arena->cache[i + 1], (arena->cached - i) * sizeof(void*));
+        memmove(&arena->cache_size[i], &arena->cache_size[i + 1], (arena->cached - i) * sizeof(size_t));
+        return p;
+    }
+    return NULL;
+}
+
+// Keep a freed mapping for reuse, unmapping the oldest ones to make room
+static inline void gmp_alloc_cache_put(gmp_arena_t* arena, void* p, size_t size) {
+    if (size > GMP_ALLOC_CACHE_BYTES) {
+        gmp_alloc_unmap(p, size);
+        return;
+    }
+    while (arena->cached == GMP_ALLOC_CACHE_SLOTS || arena->cached_bytes + size > GMP_ALLOC_CACHE_BYTES) {
+        gmp_alloc_unmap(arena->cache[0], arena->cache_size[0]);
+        arena->cached--;
+        arena->cached_bytes -= arena->cache_size[0];
+        memmove(&arena->cache[0], &arena->cache[1], arena->cached * sizeof(void*));
+        memmove(&arena->cache_size[0], &arena->cache_size[1], arena->cached * sizeof(size_t));
+    }
+    arena->cache[arena->cached] = p;
+    arena->cache_size[arena->cached] = size;
+    arena->cached++;
+    arena->cached_bytes += size;
+}
+
+// Thread exit: fold the arena's live bytes into the total and put it in the idle pool. Its
+// freelists, slab and cached mappings stay as they are for the next owner.
+static inline void gmp_alloc_thread_exit(void* arg) {
+    gmp_arena_t* arena = (gmp_arena_t*)arg;
+    __atomic_add_fetch(&gmp_alloc_live, arena->pending_live, __ATOMIC_RELAXED);
+    arena->pending_live = 0;
+    gmp_arena = NULL;
+    pthread_mutex_lock(&gmp_arena_lock);
+    arena->idle_next = gmp_arena_idle;
+    gmp_arena_idle = arena;
+    pthread_mutex_unlock(&gmp_arena_lock);
+}
+
+static inline void gmp_alloc_create_key(void) {
+    pthread_key_create(&gmp_arena_key, gmp_alloc_thread_exit);
+}
+
+// The calling thread's arena: an idle one from its own node if there is one, else a new one
+static inline gmp_arena_t* gmp_alloc_arena(void) {
+    if (gmp_arena != NULL)
+        return gmp_arena;
+    pthread_once(&gmp_arena_key_once, gmp_alloc_create_key);
+    int node = gmp_alloc_current_node();
+
+    pthread_mutex_lock(&gmp_arena_lock);
+    gmp_arena_t** link = &gmp_arena_idle;
+    while (*link != NULL && (*link)->node != node)
+        link = &(*link)->idle_next;
+    gmp_arena_t* arena = *link;
+    if (arena != NULL) {
+        *link = arena->idle_next;
+        arena->idle_next = NULL;
+    } else {
+        arena = (gmp_arena_t*)calloc(1, sizeof(gmp_arena_t));
+        arena->node = node;
+        arena->next = gmp_arena_list;
+        gmp_arena_list = arena;
+    }
+    pthread_mutex_unlock(&gmp_arena_lock);
+
+    pthread_setspecific(gmp_arena_key, arena);
+    gmp_arena = arena;
+    return arena;
+}
+
+static inline void gmp_alloc_account(gmp_arena_t* arena, long bytes) {
+    arena->pending_live += bytes;
+    if (arena->pending_live < GMP_ALLOC_FLUSH && arena->pending_live > -GMP_ALLOC_FLUSH)
+        return;
+    long live = __atomic_add_fetch(&gmp_alloc_live, arena->pending_live, __ATOMIC_RELAXED);
+    arena->pending_live = 0;
+    long peak = __atomic_load_n(&gmp_alloc_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&gmp_alloc_peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Size class of a block, or -1 for a large block
+static inline int gmp_alloc_class(size_t size) {
+    if (size > GMP_ALLOC_MAX_CLASS)
+        return -1;
+    int shift = GMP_ALLOC_MIN_SHIFT;
+    while (((size_t)1 << shift) < size)
+        shift++;
+    return shift - GMP_ALLOC_MIN_SHIFT;
+}
+
+static inline size_t gmp_alloc_large_size(size_t size) {
+    size_t page = size >= GMP_ALLOC_HUGE_PAGE ? GMP_ALLOC_HUGE_PAGE : 4096;
+    return (size + page - 1) / page * page;
+}
+
+static inline void* gmp_alloc_malloc(size_t size) {
+    gmp_arena_t* arena = gmp_alloc_arena();
+    __atomic_store_n(&arena->allocations, arena->allocations + 1, __ATOMIC_RELAXED);
+    int c = gmp_alloc_class(size);
+    if (c < 0) {
+        size_t mapped = gmp_alloc_large_size(size);
+        gmp_alloc_account(arena, (long)mapped);
+        void* p = gmp_alloc_cache_take(arena, mapped);
+        return p != NULL ? p : gmp_alloc_map(mapped, arena->node);
+    }
+
+    size_t block = (size_t)1 << (c + GMP_ALLOC_MIN_SHIFT);
+    gmp_alloc_account(arena, (long)block);
+    void* p = arena->free_lists[c];
+    if (p != NULL) {
+        arena->free_lists[c] = *(void**)p;
+        return p;
+    }
+    if (arena->bump_left < block) {
+        // Put what is left of the old slab on the freelists rather than lose it
+        for (int k = c - 1; k >= 0; k--) {
+            size_t piece = (size_t)1 << (k + GMP_ALLOC_MIN_SHIFT);
+            while (arena->bump_left >= piece) {
+                *(void**)arena->bump = arena->free_lists[k];
+                arena->free_lists[k] = arena->bump;
+                arena->bump += piece;
+                arena->bump_left -= piece;
+            }
+        }
+        arena->bump = (char*)gmp_alloc_map(GMP_ALLOC_SLAB, arena->node);
+        arena->bump_left = GMP_ALLOC_SLAB;
+    }
+    p = arena->bump;
+    arena->bump += block;
+    arena->bump_left -= block;
+    return p;
+}
+
+static inline void gmp_alloc_free(void* p, size_t size) {
+    if (p == NULL)
+        return;
+    gmp_arena_t* arena = gmp_alloc_arena();
+    int c = gmp_alloc_class(size);
+    if (c < 0) {
+        size_t mapped = gmp_alloc_large_size(size);
+        gmp_alloc_account(arena, -(long)mapped);
+        gmp_alloc_cache_put(arena, p, mapped);
+        return;
+    }
+    gmp_alloc_account(arena, -(long)((size_t)1 << (c + GMP_ALLOC_MIN_SHIFT)));
+    *(void**)p = arena->free_lists[c];
+    arena->free_lists[c] = p;
+}
+
+static inline void* gmp_alloc_realloc(void* p, size_t old_size, size_t new_size) {
+    int old_class = gmp_alloc_class(old_size);
+    int new_class = gmp_alloc_class(new_size);
+    if (old_class >= 0 && old_class == new_class)
+        return p;
+    if (old_class < 0 && new_class < 0 && gmp_alloc_large_size(old_size) == gmp_alloc_large_size(new_size))
+        return p;
+    void* q = gmp_alloc_malloc(new_size);
+    memcpy(q, p, old_size < new_size ? old_size : new_size);
+    gmp_alloc_free(p, old_size);
+    return q;
+}
+
+// Route all GMP allocations through the arenas. Call first thing in main, before any mpz_init.
+static inline void gmp_alloc_install(void) {
+    mp_set_memory_functions(gmp_alloc_malloc, gmp_alloc_realloc, gmp_alloc_free);
+}
+
+static inline void gmp_alloc_get_stats(gmp_alloc_stats_t* stats) {
+    long live = __atomic_load_n(&gmp_alloc_live, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&gmp_alloc_peak, __ATOMIC_RELAXED);
+    stats->live = live > 0 ? (size_t)live : 0;
+    stats->peak = peak > 0 ? (size_t)peak : 0;
+    stats->mapped = __atomic_load_n(&gmp_alloc_mapped, __ATOMIC_RELAXED);
+    stats->allocations = 0;
+    pthread_mutex_lock(&gmp_arena_lock);
+    for (gmp_arena_t* arena = gmp_arena_list; arena != NULL; arena = arena->next)
+        stats->allocations += __atomic_load_n(&arena->allocations, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&gmp_arena_lock);
+}
+
+#endif
@@ -0,0 +1,907 @@
+// Irrational-base discrete weighted transform (IBDWT) squaring mod 2^p - 1.
+//
+// Following Crandall and Fagin, a residue is split into n digits of floor(p/n) or ceil(p/n)
+// bits, digit j starting at bit ceil(p*j/n). Multiplying digit j by 2^(ceil(p*j/n) - p*j/n)
+// before a length n cyclic convolution makes the wraparound mod 2^p - 1 come for free, so one
+// squaring is a forward FFT, a pointwise square, an inverse FFT and a carry pass. A product of
+// two different residues takes a second forward FFT and a pointwise multiply instead.
+//
+// The convolution is a double precision real FFT, computed as a complex FFT of length n/2 plus
+// a split/merge step. Digits are kept balanced (|digit| <= 2^(bits-1)) to hold round-off down,
+// and every carry pass records the largest distance of an output from the nearest integer, so a
+// length that turns out too short is caught and the test is retried one length up.
+//
+// The butterflies have AVX2/FMA versions that are picked at runtime when the CPU has them.
+//
+// A team of threads can share every squaring of one residue. Each member owns a contiguous
+// slice of points: it weights and carries its own digits, and takes an equal share of the
+// butterflies of every FFT stage. Members wait at a barrier only between stages that cross
+// slice boundaries; the small stages stay inside a slice and run back to back. Carries out of
+// each slice are pushed into the next one by the leader, and each member moves the pages of
+// its slice to its own NUMA node when a transform is set up.
+
+#ifndef IBDWT_H
+#define IBDWT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <gmp.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "mersenne-mod.h"
+
+#define IBDWT_MIN_LENGTH 64
+#define IBDWT_MAX_ERROR 0.35        // round-off above this means the FFT length is too short
+#define IBDWT_SNAPSHOT_INTERVAL 10000 // iterations between in-memory snapshots for retries
+#define IBDWT_MAX_MULTIPLIER (1L << 20) // largest small multiplier the carry pass keeps exact
+#define IBDWT_TEAM_MIN_LENGTH 8192    // shorter transforms are squared by the leader alone
+#define IBDWT_MPOL_PREFERRED 1
+#define IBDWT_MPOL_MF_MOVE 2
+
+// Jobs a team runs together
+#define IBDWT_JOB_SQUARE 0
+#define IBDWT_JOB_PLACE 1
+#define IBDWT_JOB_STOP 2
+
+typedef struct {
+    unsigned long p;
+    size_t n;               // real digits
+    size_t m;               // complex points, n / 2
+    unsigned char* bits;    // bits in digit j
+    double* weight;         // 2^(ceil(p*j/n) - p*j/n)
+    double* unweight;       // 1 / (weight * m)
+    double* digits;         // balanced digits
+    double* re;             // FFT work arrays, m entries each
+    double* im;
+    double* tw_re;          // twiddles e^(-2 pi i j / 2h) for a stage of half size h live at [h + j]
+    double* tw_im;
+    double* split_re;       // e^(-2 pi i k / n) for the real split/merge, k < m
+    double* split_im;
+    size_t* bitrev;
+    double max_error;
+    int use_avx2;
+} ibdwt_t;
+
+static inline double* ibdwt_alloc_doubles(size_t count) {
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, 64, (count + 8) * sizeof(double)) != 0)
+        return NULL;
+    memset(ptr, 0, (count + 8) * sizeof(double));
+    return (double*)ptr;
+}
+
+// Largest bits per digit that keeps round-off comfortably below 0.5 at length n. Fitted to
+// runs of this transform: the worst error stays near 0.05 along this line.
+static inline double ibdwt_max_bits(size_t n) {
+    return 23.6 - 0.32 * log2((double)n);
+}
+
+// Shortest power-of-two length whose bits per digit stay inside ibdwt_max_bits
+static inline size_t ibdwt_choose_length(unsigned long p) {
+    size_t n = IBDWT_MIN_LENGTH;
+    while ((double)p / n > ibdwt_max_bits(n))
+        n *= 2;
+    return n;
+}
+
+static inline void ibdwt_init(ibdwt_t* t, unsigned long p, size_t n) {
+    t->p = p;
+    t->n = n;
+    t->m = n / 2;
+    t->bits = (unsigned char*)malloc(n);
+    t->weight = ibdwt_alloc_doubles(n);
+    t->unweight = ibdwt_alloc_doubles(n);
+    t->digits = ibdwt_alloc_doubles(n);
+    t->re = ibdwt_alloc_doubles(t->m);
+    t->im = ibdwt_alloc_doubles(t->m);
+    t->tw_re = ibdwt_alloc_doubles(t->m);
+    t->tw_im = ibdwt_alloc_doubles(t->m);
+    t->split_re = ibdwt_alloc_doubles(t->m);
+    t->split_im = ibdwt_alloc_doubles(t->m);
+    t->bitrev = (size_t*)malloc(t->m * sizeof(size_t));
+    t->max_error = 0.0;
+    t->use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+    for (size_t j = 0; j < n; j++) {
+        uint64_t start = ((uint64_t)p * j + n - 1) / n;
+        uint64_t end = ((uint64_t)p * (j + 1) + n - 1) / n;
+        t->bits[j] = (unsigned char)(end - start);
+        // ceil(p*j/n) - p*j/n, exactly, as a fraction of n
+        double frac = (double)(start * n - (uint64_t)p * j) / n;
+        t->weight[j] = exp2(frac);
+        t->unweight[j] = 1.0 / (t->weight[j] * t->m);
+    }
+
+    for (size_t h = 1; h < t->m; h *= 2) {
+        for (size_t j = 0; j < h; j++) {
+            double angle = -M_PI * (double)j / (double)h;
+            t->tw_re[h + j] = cos(angle);
+            t->tw_im[h + j] = sin(angle);
+        }
+    }
+
+    for (size_t k = 0; k < t->m; k++) {
+        double angle = -2.0 * M_PI * (double)k / (double)n;
+        t->split_re[k] = cos(angle);
+        t->split_im[k] = sin(angle);
+    }
+
+    int log_m = 0;
+    while (((size_t)1 << log_m) < t->m)
+        log_m++;
+    for (size_t k = 0; k < t->m; k++) {
+        size_t r = 0;
+        for (int b = 0; b < log_m; b++)
+            if (k & ((size_t)1 << b))
+                r |= (size_t)1 << (log_m - 1 - b);
+        t->bitrev[k] = r;
+    }
+}
+
+static inline void ibdwt_clear(ibdwt_t* t) {
+    free(t->bits);
+    free(t->weight);
+    free(t->unweight);
+    free(t->digits);
+    free(t->re);
+    free(t->im);
+    free(t->tw_re);
+    free(t->tw_im);
+    free(t->split_re);
+    free(t->split_im);
+    free(t->bitrev);
+}
+
+// Bytes a session for p holds at its starting length, the snapshot and the limb conversion
+// buffer included
+static inline size_t ibdwt_memory(unsigned long p) {
+    size_t n = ibdwt_choose_length(p);
+    size_t m = n / 2;
+    return n + 4 * (n + 8) * sizeof(double) + 6 * (m + 8) * sizeof(double) + m * sizeof(size_t) + n * sizeof(int64_t);
+}
+
+// Bytes ibdwt_session_mul adds to a session for p
+static inline size_t ibdwt_mul_memory(unsigned long p) {
+    return 2 * (ibdwt_choose_length(p) / 2 + 8) * sizeof(double);
+}
+
+// A stage of half size h is m / 2 butterflies; butterfly b pairs points s + j and s + j + h
+// of block s = b / h * 2h, j = b % h. Stages run over butterflies [first, last), so a team can
+// split one stage anywhere; with AVX2 the bounds must be multiples of 4.
+
+// The part of the block holding butterfly b that falls in [b, last): offsets [j0, j1) from s
+static inline void ibdwt_stage_span(size_t h, size_t b, size_t last, size_t* s, size_t* j0, size_t* j1) {
+    *s = b / h * 2 * h;
+    *j0 = b % h;
+    *j1 = *j0 + (last - b) < h ? *j0 + (last - b) : h;
+}
+
+// One decimation-in-frequency stage of half size h over butterflies [first, last)
+static inline void ibdwt_dif_stage_scalar(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    double* re = t->re;
+    double* im = t->im;
+    const double* wr = t->tw_re + h;
+    const double* wi = t->tw_im + h;
+    for (size_t b = first; b < last; ) {
+        size_t s, j0, j1;
+        ibdwt_stage_span(h, b, last, &s, &j0, &j1);
+        b += j1 - j0;
+        for (size_t j = j0; j < j1; j++) {
+            double ar = re[s + j], ai = im[s + j];
+            double br = re[s + j + h], bi = im[s + j + h];
+            double dr = ar - br, di = ai - bi;
+            re[s + j] = ar + br;
+            im[s + j] = ai + bi;
+            re[s + j + h] = dr * wr[j] - di * wi[j];
+            im[s + j + h] = dr * wi[j] + di * wr[j];
+        }
+    }
+}
+
+// One decimation-in-time stage of half size h with conjugate twiddles (inverse transform)
+static inline void ibdwt_dit_stage_scalar(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    double* re = t->re;
+    double* im = t->im;
+    const double* wr = t->tw_re + h;
+    const double* wi = t->tw_im + h;
+    for (size_t b = first; b < last; ) {
+        size_t s, j0, j1;
+        ibdwt_stage_span(h, b, last, &s, &j0, &j1);
+        b += j1 - j0;
+        for (size_t j = j0; j < j1; j++) {
+            double br0 = re[s + j + h], bi0 = im[s + j + h];
+            double br = br0 * wr[j] + bi0 * wi[j];
+            double bi = bi0 * wr[j] - br0 * wi[j];
+            double ar = re[s + j], ai = im[s + j];
+            re[s + j] = ar + br;
+            im[s + j] = ai + bi;
+            re[s + j + h] = ar - br;
+            im[s + j + h] = ai - bi;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static inline void ibdwt_dif_stage_avx2(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    double* re = t->re;
+    double* im = t->im;
+    const double* wr = t->tw_re + h;
+    const double* wi = t->tw_im + h;
+    for (size_t b = first; b < last; ) {
+        size_t s, j0, j1;
+        ibdwt_stage_span(h, b, last, &s, &j0, &j1);
+        b += j1 - j0;
+        for (size_t j = j0; j < j1; j += 4) {
+            __m256d ar = _mm256_load_pd(re + s + j), ai = _mm256_load_pd(im + s + j);
+            __m256d br = _mm256_load_pd(re + s + j + h), bi = _mm256_load_pd(im + s + j + h);
+            __m256d cr = _mm256_loadu_pd(wr + j), ci = _mm256_loadu_pd(wi + j);
+            __m256d dr = _mm256_sub_pd(ar, br), di = _mm256_sub_pd(ai, bi);
+            _mm256_store_pd(re + s + j, _mm256_add_pd(ar, br));
+            _mm256_store_pd(im + s + j, _mm256_add_pd(ai, bi));
+            _mm256_store_pd(re + s + j + h, _mm256_fmsub_pd(dr, cr, _mm256_mul_pd(di, ci)));
+            _mm256_store_pd(im + s + j + h, _mm256_fmadd_pd(dr, ci, _mm256_mul_pd(di, cr)));
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static inline void ibdwt_dit_stage_avx2(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    double* re = t->re;
+    double* im = t->im;
+    const double* wr = t->tw_re + h;
+    const double* wi = t->tw_im + h;
+    for (size_t b = first; b < last; ) {
+        size_t s, j0, j1;
+        ibdwt_stage_span(h, b, last, &s, &j0, &j1);
+        b += j1 - j0;
+        for (size_t j = j0; j < j1; j += 4) {
+            __m256d cr = _mm256_loadu_pd(wr + j), ci = _mm256_loadu_pd(wi + j);
+            __m256d br0 = _mm256_load_pd(re + s + j + h), bi0 = _mm256_load_pd(im + s + j + h);
+            __m256d br = _mm256_fmadd_pd(br0, cr, _mm256_mul_pd(bi0, ci));
+            __m256d bi = _mm256_fmsub_pd(bi0, cr, _mm256_mul_pd(br0, ci));
+            __m256d ar = _mm256_load_pd(re + s + j), ai = _mm256_load_pd(im + s + j);
+            _mm256_store_pd(re + s + j, _mm256_add_pd(ar, br));
+            _mm256_store_pd(im + s + j, _mm256_add_pd(ai, bi));
+            _mm256_store_pd(re + s + j + h, _mm256_sub_pd(ar, br));
+            _mm256_store_pd(im + s + j + h, _mm256_sub_pd(ai, bi));
+        }
+    }
+}
+
+static inline void ibdwt_dif_stage(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    if (t->use_avx2 && h >= 4)
+        ibdwt_dif_stage_avx2(t, h, first, last);
+    else
+        ibdwt_dif_stage_scalar(t, h, first, last);
+}
+
+static inline void ibdwt_dit_stage(ibdwt_t* t, size_t h, size_t first, size_t last) {
+    if (t->use_avx2 && h >= 4)
+        ibdwt_dit_stage_avx2(t, h, first, last);
+    else
+        ibdwt_dit_stage_scalar(t, h, first, last);
+}
+
+// Weight the digits and pack pairs into complex points k in [first, last)
+static inline void ibdwt_weight(ibdwt_t* t, size_t first, size_t last) {
+    for (size_t k = first; k < last; k++) {
+        t->re[k] = t->digits[2 * k] * t->weight[2 * k];
+        t->im[k] = t->digits[2 * k + 1] * t->weight[2 * k + 1];
+    }
+}
+
+// Real spectrum points X_k and X_j, j = m - k, out of the bit-reversed half-length spectrum
+// Z in re/im: with E = (Z_k + conj Z_j) / 2 and O = (Z_k - conj Z_j) / 2i, X_k = E + w_k O and
+// X_j = conj E + w_j conj O
+static inline void ibdwt_split_pair(const ibdwt_t* t, const double* re, const double* im, size_t k,
+                                    double* xkr, double* xki, double* xjr, double* xji) {
+    size_t j = t->m - k;
+    size_t rk = t->bitrev[k], rj = t->bitrev[j];
+    double zkr = re[rk], zki = im[rk], zjr = re[rj], zji = im[rj];
+
+    double er = 0.5 * (zkr + zjr), ei = 0.5 * (zki - zji);
+    double or_ = 0.5 * (zki + zji), oi = -0.5 * (zkr - zjr);
+    double wkr = t->split_re[k], wki = t->split_im[k];
+    double wjr = t->split_re[j], wji = t->split_im[j];
+
+    *xkr = er + wkr * or_ - wki * oi;
+    *xki = ei + wkr * oi + wki * or_;
+    *xjr = er + wjr * or_ + wji * oi;
+    *xji = -ei - wjr * oi + wji * or_;
+}
+
+// Fold the products Y_k, Y_j back into the half-length spectrum ready for the inverse transform
+static inline void ibdwt_merge_pair(ibdwt_t* t, size_t k, double ykr, double yki, double yjr, double yji) {
+    size_t j = t->m - k;
+    size_t rk = t->bitrev[k], rj = t->bitrev[j];
+    double wkr = t->split_re[k], wki = t->split_im[k];
+    double wjr = t->split_re[j], wji = t->split_im[j];
+
+    // E' = (Y_k + conj Y_j) / 2, O' = (Y_k - conj Y_j) conj(w_k) / 2, W_k = E' + i O'
+    double e2r = 0.5 * (ykr + yjr), e2i = 0.5 * (yki - yji);
+    double dr = 0.5 * (ykr - yjr), di = 0.5 * (yki + yji);
+    double o2r = dr * wkr + di * wki, o2i = di * wkr - dr * wki;
+    t->re[rk] = e2r - o2i;
+    t->im[rk] = e2i + o2r;
+
+    // W_j = conj E' + i O'_j with O'_j = (Y_j - conj Y_k) conj(w_j) / 2
+    double fr = -dr, fi = di;
+    double o3r = fr * wjr + fi * wji, o3i = fi * wjr - fr * wji;
+    t->re[rj] = e2r - o3i;
+    t->im[rj] = -e2i + o3r;
+}
+
+// Turn the bit-reversed half-length spectrum into the real spectrum, square it, and fold it
+// back into a half-length spectrum ready for the inverse transform. Pairs (k, m - k) for
+// k in [first, last), with 1 <= first and last <= m / 2 + 1.
+static inline void ibdwt_square_spectrum(ibdwt_t* t, size_t first, size_t last) {
+    for (size_t k = first; k < last; k++) {
+        double xkr, xki, xjr, xji;
+        ibdwt_split_pair(t, t->re, t->im, k, &xkr, &xki, &xjr, &xji);
+        ibdwt_merge_pair(t, k, xkr * xkr - xki * xki, 2.0 * xkr * xki, xjr * xjr - xji * xji, 2.0 * xjr * xji);
+    }
+}
+
+// The k = 0 point pairs with itself and with the Nyquist frequency
+static inline void ibdwt_square_spectrum_dc(ibdwt_t* t) {
+    double e = t->re[0], o = t->im[0];
+    double y0 = (e + o) * (e + o), ym = (e - o) * (e - o);
+    t->re[0] = 0.5 * (y0 + ym);
+    t->im[0] = 0.5 * (y0 - ym);
+}
+
+// ibdwt_square_spectrum for a product: multiplies by the spectrum in b_re/b_im, laid out the
+// way the forward transform leaves re/im
+static inline void ibdwt_mul_spectrum(ibdwt_t* t, const double* b_re, const double* b_im) {
+    double e = t->re[0], o = t->im[0];
+    double y0 = (e + o) * (b_re[0] + b_im[0]), ym = (e - o) * (b_re[0] - b_im[0]);
+    t->re[0] = 0.5 * (y0 + ym);
+    t->im[0] = 0.5 * (y0 - ym);
+
+    for (size_t k = 1; k <= t->m / 2; k++) {
+        double akr, aki, ajr, aji, bkr, bki, bjr, bji;
+        ibdwt_split_pair(t, t->re, t->im, k, &akr, &aki, &ajr, &aji);
+        ibdwt_split_pair(t, b_re, b_im, k, &bkr, &bki, &bjr, &bji);
+        ibdwt_merge_pair(t, k, akr * bkr - aki * bki, akr * bki + aki * bkr, ajr * bjr - aji * bji, ajr * bji + aji * bjr);
+    }
+}
+
+// Unweight, round and carry digits [first, last) in base 2^bits[j]. Each digit of the square is
+// balanced first and then multiplied by multiplier in a second carry chain that starts at addend,
+// so both chains only ever hold exact integers. Returns the combined carry out of the last digit;
+// the caller wraps it to the bottom (2^p = 1).
+static inline double ibdwt_carry(ibdwt_t* t, size_t first, size_t last, double multiplier, double addend, double* max_error) {
+    double err = *max_error;
+    double square_carry = 0.0, carry = addend;
+    for (size_t k = first / 2; k < (last + 1) / 2; k++) {
+        t->digits[2 * k] = t->re[k];
+        t->digits[2 * k + 1] = t->im[k];
+    }
+    for (size_t j = first; j < last; j++) {
+        double value = t->digits[j] * t->unweight[j];
+        double rounded = rint(value);
+        double e = fabs(value - rounded);
+        if (e > err)
+            err = e;
+        double base = (double)(1ULL << t->bits[j]);
+        rounded += square_carry;
+        square_carry = rint(rounded / base);
+        double digit = (rounded - square_carry * base) * multiplier + carry;
+        carry = rint(digit / base);
+        t->digits[j] = digit - carry * base;
+    }
+    *max_error = err;
+    return square_carry * multiplier + carry;
+}
+
+// Push a carry through the digits starting at digit j, wrapping past the top as often as needed
+static inline void ibdwt_wrap_carry(ibdwt_t* t, size_t j, double carry) {
+    while (carry != 0.0) {
+        double base = (double)(1ULL << t->bits[j]);
+        double value = t->digits[j] + carry;
+        carry = rint(value / base);
+        t->digits[j] = value - carry * base;
+        j = j + 1 == t->n ? 0 : j + 1;
+    }
+}
+
+// Weight the digits and leave their bit-reversed half-length spectrum in re/im
+static inline void ibdwt_forward(ibdwt_t* t) {
+    size_t m = t->m;
+    ibdwt_weight(t, 0, m);
+    for (size_t h = m / 2; h >= 1; h /= 2)
+        ibdwt_dif_stage(t, h, 0, m / 2);
+}
+
+// Inverse transform of re/im back into digits, times multiplier minus subtrahend
+static inline void ibdwt_inverse(ibdwt_t* t, long multiplier, long subtrahend) {
+    size_t m = t->m;
+    for (size_t h = 1; h < m; h *= 2)
+        ibdwt_dit_stage(t, h, 0, m / 2);
+
+    double carry = ibdwt_carry(t, 0, t->n, (double)multiplier, (double)-subtrahend, &t->max_error);
+    ibdwt_wrap_carry(t, 0, carry);
+}
+
+// digits = digits^2 * multiplier - subtrahend mod 2^p - 1, with multiplier < IBDWT_MAX_MULTIPLIER
+static inline void ibdwt_square(ibdwt_t* t, long multiplier, long subtrahend) {
+    ibdwt_forward(t);
+    ibdwt_square_spectrum_dc(t);
+    ibdwt_square_spectrum(t, 1, t->m / 2 + 1);
+    ibdwt_inverse(t, multiplier, subtrahend);
+}
+
+// digits = digits * b mod 2^p - 1, where b_re/b_im hold b's spectrum from ibdwt_forward
+static inline void ibdwt_mul(ibdwt_t* t, const double* b_re, const double* b_im) {
+    ibdwt_forward(t);
+    ibdwt_mul_spectrum(t, b_re, b_im);
+    ibdwt_inverse(t, 1, 0);
+}
+
+typedef struct ibdwt_team ibdwt_team_t;
+
+typedef struct {
+    ibdwt_team_t* team;
+    int id;                     // 0 is the leader, the thread that owns the test
+} ibdwt_member_t;
+
+struct ibdwt_team {
+    int size;                   // members, the leader included
+    ibdwt_t* t;                 // transform the team works on
+    int job;
+    double multiplier, addend;
+    pthread_barrier_t barrier;
+    pthread_t* threads;         // helpers, size - 1 of them
+    ibdwt_member_t* members;
+    int* cpus;                  // CPU for each helper, or NULL to leave them unpinned
+    double* carries;            // carry out of each member's digits
+    double* errors;             // round-off seen by each member
+};
+
+// Member id's share [first, last) of count items, bounds on multiples of align
+static inline void ibdwt_team_range(const ibdwt_team_t* team, int id, size_t count, size_t align, size_t* first, size_t* last) {
+    *first = count * id / team->size / align * align;
+    *last = id + 1 == team->size ? count : count * (id + 1) / team->size / align * align;
+}
+
+// Alignment of the member bounds for a transform of m points: a power of two small enough to
+// keep the shares within about 1/8 of each other, and at least 4 for the AVX2 butterflies
+static inline size_t ibdwt_team_align(const ibdwt_team_t* team, size_t m) {
+    size_t align = 4;
+    while (align * 2 * 8 * team->size <= m / 2)
+        align *= 2;
+    return align;
+}
+
+// Stages of half size up to this touch only the member's own points, so no barrier is needed
+// between them: the largest power of two dividing every bound
+static inline size_t ibdwt_team_local(const ibdwt_team_t* team, size_t count, size_t align) {
+    size_t local = count;
+    for (int id = 1; id < team->size; id++) {
+        size_t first, last;
+        ibdwt_team_range(team, id, count, align, &first, &last);
+        size_t low = first & (~first + 1);
+        if (first != 0 && low < local)
+            local = low;
+    }
+    return local;
+}
+
+// Move the pages of this member's slice to the NUMA node it runs on
+static inline void ibdwt_team_place(ibdwt_team_t* team, int id) {
+    ibdwt_t* t = team->t;
+    size_t align = ibdwt_team_align(team, t->m);
+    size_t first, last;
+    ibdwt_team_range(team, id, t->m, align, &first, &last);
+
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= 64)
+        return;
+    unsigned long mask = 1UL << node;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    double* slices[5][2] = {
+        {t->re + first, t->re + last}, {t->im + first, t->im + last},
+        {t->digits + 2 * first, t->digits + 2 * last},
+        {t->weight + 2 * first, t->weight + 2 * last},
+        {t->unweight + 2 * first, t->unweight + 2 * last},
+    };
+    for (int i = 0; i < 5; i++) {
+        uintptr_t start = ((uintptr_t)slices[i][0] + page - 1) / page * page;
+        uintptr_t end = (uintptr_t)slices[i][1] / page * page;
+        if (end > start)
+            syscall(SYS_mbind, (void*)start, end - start, IBDWT_MPOL_PREFERRED, &mask, 64, IBDWT_MPOL_MF_MOVE);
+    }
+}
+
+// Member id's part of one ibdwt_square
+static inline void ibdwt_team_square(ibdwt_team_t* team, int id) {
+    ibdwt_t* t = team->t;
+    size_t m = t->m, half = m / 2;
+    size_t align = ibdwt_team_align(team, m);
+    size_t local = ibdwt_team_local(team, half, align);
+    size_t first, last, b0, b1, k0, k1;
+    ibdwt_team_range(team, id, m, align, &first, &last);
+    ibdwt_team_range(team, id, half, align, &b0, &b1);
+    ibdwt_team_range(team, id, half, 1, &k0, &k1);
+
+    ibdwt_weight(t, first, last);
+    pthread_barrier_wait(&team->barrier);
+    for (size_t h = half; h >= 1; h /= 2) {
+        ibdwt_dif_stage(t, h, b0, b1);
+        if (h > local)
+            pthread_barrier_wait(&team->barrier);
+    }
+    pthread_barrier_wait(&team->barrier);
+
+    if (id == 0)
+        ibdwt_square_spectrum_dc(t);
+    ibdwt_square_spectrum(t, k0 + 1, k1 + 1);
+    pthread_barrier_wait(&team->barrier);
+
+    for (size_t h = 1; h < m; h *= 2) {
+        if (h > local)
+            pthread_barrier_wait(&team->barrier);
+        ibdwt_dit_stage(t, h, b0, b1);
+    }
+    pthread_barrier_wait(&team->barrier);
+
+    team->errors[id] = 0.0;
+    team->carries[id] = ibdwt_carry(t, 2 * first, 2 * last, team->multiplier, id == 0 ? team->addend : 0.0, &team->errors[id]);
+    pthread_barrier_wait(&team->barrier);
+    if (id != 0)
+        return;
+
+    // Carry each slice into the next, the last one round to digit 0
+    for (int i = 0; i < team->size; i++) {
+        size_t next_first, next_last;
+        ibdwt_team_range(team, (i + 1) % team->size, m, align, &next_first, &next_last);
+        ibdwt_wrap_carry(t, 2 * next_first, team->carries[i]);
+        if (team->errors[i] > t->max_error)
+            t->max_error = team->errors[i];
+    }
+}
+
+static inline void ibdwt_team_job(ibdwt_team_t* team, int id) {
+    if (team->job == IBDWT_JOB_SQUARE) {
+        ibdwt_team_square(team, id);
+    } else if (team->job == IBDWT_JOB_PLACE) {
+        ibdwt_team_place(team, id);
+        pthread_barrier_wait(&team->barrier);
+    }
+}
+
+static inline void* ibdwt_team_helper(void* arg) {
+    ibdwt_member_t* member = (ibdwt_member_t*)arg;
+    ibdwt_team_t* team = member->team;
+    if (team->cpus != NULL) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(team->cpus[member->id - 1], &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    }
+    for (;;) {
+        pthread_barrier_wait(&team->barrier);
+        if (team->job == IBDWT_JOB_STOP)
+            break;
+        ibdwt_team_job(team, member->id);
+    }
+    return NULL;
+}
+
+// Start size - 1 helper threads for the calling thread to lead. cpus, if not NULL, holds a
+// CPU for each helper to be pinned to.
+static inline void ibdwt_team_init(ibdwt_team_t* team, int size, const int* cpus) {
+    team->size = size;
+    team->t = NULL;
+    team->job = IBDWT_JOB_SQUARE;
+    team->threads = (pthread_t*)malloc(size * sizeof(pthread_t));
+    team->members = (ibdwt_member_t*)malloc(size * sizeof(ibdwt_member_t));
+    team->carries = (double*)calloc(size, sizeof(double));
+    team->errors = (double*)calloc(size, sizeof(double));
+    team->cpus = NULL;
+    if (cpus != NULL) {
+        team->cpus = (int*)malloc(size * sizeof(int));
+        memcpy(team->cpus, cpus, (size - 1) * sizeof(int));
+    }
+    pthread_barrier_init(&team->barrier, NULL, size);
+    for (int i = 1; i < size; i++) {
+        team->members[i].team = team;
+        team->members[i].id = i;
+        if (pthread_create(&team->threads[i - 1], NULL, ibdwt_team_helper, &team->members[i]) != 0) {
+            perror("Failed to create team thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Run a job on every member, the calling thread being member 0
+static inline void ibdwt_team_run(ibdwt_team_t* team, int job) {
+    team->job = job;
+    pthread_barrier_wait(&team->barrier);
+    if (job != IBDWT_JOB_STOP)
+        ibdwt_team_job(team, 0);
+}
+
+static inline void ibdwt_team_clear(ibdwt_team_t* team) {
+    ibdwt_team_run(team, IBDWT_JOB_STOP);
+    for (int i = 1; i < team->size; i++)
+        pthread_join(team->threads[i - 1], NULL);
+    pthread_barrier_destroy(&team->barrier);
+    free(team->threads);
+    free(team->members);
+    free(team->carries);
+    free(team->errors);
+    free(team->cpus);
+}
+
+// Hand t to the team, or leave it to the caller alone when t is too short to be worth sharing
+static inline int ibdwt_team_attach(ibdwt_team_t* team, ibdwt_t* t) {
+    if (team == NULL || team->size < 2 || t->n < IBDWT_TEAM_MIN_LENGTH)
+        return 0;
+    team->t = t;
+    ibdwt_team_run(team, IBDWT_JOB_PLACE);
+    return 1;
+}
+
+// ibdwt_square on a team that t is attached to
+static inline void ibdwt_team_square_all(ibdwt_team_t* team, long multiplier, long subtrahend) {
+    team->multiplier = (double)multiplier;
+    team->addend = (double)-subtrahend;
+    ibdwt_team_run(team, IBDWT_JOB_SQUARE);
+}
+
+// Load a residue given as n_limbs little-endian limbs (value < 2^p) into balanced digits
+static inline void ibdwt_set_limbs(ibdwt_t* t, const mp_limb_t* limbs, mp_size_t n_limbs) {
+    uint64_t position = 0;
+    double carry = 0.0;
+    for (size_t j = 0; j < t->n; j++) {
+        unsigned int bits = t->bits[j];
+        uint64_t value = 0;
+        for (unsigned int b = 0; b < bits; ) {
+            uint64_t bit = position + b;
+            mp_size_t limb = (mp_size_t)(bit / GMP_NUMB_BITS);
+            unsigned int shift = (unsigned int)(bit % GMP_NUMB_BITS);
+            unsigned int take = GMP_NUMB_BITS - shift < bits - b ? GMP_NUMB_BITS - shift : bits - b;
+            uint64_t chunk = limb < n_limbs ? (uint64_t)(limbs[limb] >> shift) : 0;
+            if (take < 64)
+                chunk &= ((uint64_t)1 << take) - 1;
+            value |= chunk << b;
+            b += take;
+        }
+        position += bits;
+
+        double digit = (double)value + carry;
+        double base = (double)(1ULL << bits);
+        carry = digit >= base / 2 ? 1.0 : 0.0;
+        t->digits[j] = digit - carry * base;
+    }
+    ibdwt_wrap_carry(t, 0, carry);
+}
+
+// Store the residue as mod->n limbs, fully reduced mod 2^p - 1
+static inline void ibdwt_get_limbs(ibdwt_t* t, special_mod_t* mod, mp_limb_t* limbs) {
+    int64_t* plain = (int64_t*)malloc(t->n * sizeof(int64_t));
+    int64_t carry = 0;
+    for (size_t j = 0; j < t->n; j++)
+        plain[j] = (int64_t)t->digits[j];
+
+    // Make every digit non-negative, wrapping the top carry back to digit 0 (2^p = 1)
+    do {
+        for (size_t j = 0; j < t->n; j++) {
+            int64_t value = plain[j] + carry;
+            carry = value >> t->bits[j];
+            plain[j] = value - (carry << t->bits[j]);
+        }
+    } while (carry != 0);
+
+    memset(limbs, 0, mod->n * sizeof(mp_limb_t));
+    uint64_t position = 0;
+    for (size_t j = 0; j < t->n; j++) {
+        uint64_t value = (uint64_t)plain[j];
+        mp_size_t limb = (mp_size_t)(position / GMP_NUMB_BITS);
+        unsigned int shift = (unsigned int)(position % GMP_NUMB_BITS);
+        limbs[limb] |= (mp_limb_t)(value << shift);
+        if (shift + t->bits[j] > GMP_NUMB_BITS)
+            limbs[limb + 1] |= (mp_limb_t)(value >> (GMP_NUMB_BITS - shift));
+        position += t->bits[j];
+    }
+    free(plain);
+
+    // 2^p - 1 itself is 0
+    if (mpn_cmp(limbs, mod->modulus, mod->n) >= 0)
+        mpn_sub_n(limbs, limbs, mod->modulus, mod->n);
+}
+
+// A transform kept for a whole test. It is set up once, grows when round-off forces a longer
+// length and stays at that length, and keeps the residue it last squared in its digits, so
+// a caller that squares the same residue chunk after chunk pays for the limb conversions
+// only when it actually reads the limbs.
+typedef struct {
+    special_mod_t* mod;         // 2^p - 1
+    ibdwt_team_t* team;         // NULL for none
+    ibdwt_t t;
+    int shared;                 // t is attached to the team
+    double* snapshot;           // digits at the last snapshot, to retry from when round-off is too large
+    mp_limb_t* resident;        // residue whose value is in t.digits, NULL for none
+    int stale;                  // resident's limbs are older than the digits
+    double* mul_re;             // spectrum of the second factor of ibdwt_session_mul, set up on first use
+    double* mul_im;
+} ibdwt_session_t;
+
+static inline void ibdwt_session_setup(ibdwt_session_t* session, size_t n) {
+    ibdwt_init(&session->t, session->mod->p, n);
+    session->shared = ibdwt_team_attach(session->team, &session->t);
+    session->snapshot = ibdwt_alloc_doubles(n);
+    session->mul_re = NULL;
+    session->mul_im = NULL;
+}
+
+// With a team (NULL for none) the calling thread leads it through every squaring
+static inline void ibdwt_session_init(ibdwt_session_t* session, special_mod_t* mod, ibdwt_team_t* team) {
+    session->mod = mod;
+    session->team = team;
+    session->resident = NULL;
+    session->stale = 0;
+    ibdwt_session_setup(session, ibdwt_choose_length(mod->p));
+}
+
+// Frees the transform; sync first if the resident residue is still needed
+static inline void ibdwt_session_clear(ibdwt_session_t* session) {
+    free(session->snapshot);
+    free(session->mul_re);
+    free(session->mul_im);
+    ibdwt_clear(&session->t);
+}
+
+// Write the digits back into the resident residue's limbs. Call before reading those limbs.
+static inline void ibdwt_session_sync(ibdwt_session_t* session) {
+    if (session->resident != NULL && session->stale)
+        ibdwt_get_limbs(&session->t, session->mod, session->resident);
+    session->stale = 0;
+}
+
+// s = s^2 * multiplier - subtrahend, iterations times, with multiplier < IBDWT_MAX_MULTIPLIER.
+// s is a reduced residue of the session's modulus. Its limbs are left stale until the next
+// ibdwt_session_sync, and squaring s again before that goes on from the digits. A snapshot
+// is kept every IBDWT_SNAPSHOT_INTERVAL iterations and the run restarts from it one FFT
+// length up whenever round-off gets too large.
+static inline void ibdwt_session_iterate(ibdwt_session_t* session, mp_limb_t* s, unsigned long iterations,
+                                         long multiplier, long subtrahend) {
+    ibdwt_t* t = &session->t;
+    if (session->resident != s || !session->stale) {
+        ibdwt_session_sync(session);
+        ibdwt_set_limbs(t, s, session->mod->n);
+        session->resident = s;
+    }
+    session->stale = 1;
+    memcpy(session->snapshot, t->digits, t->n * sizeof(double));
+    unsigned long snapshot_iteration = 0;
+
+    for (unsigned long i = 0; i < iterations; ) {
+        t->max_error = 0.0;
+        if (session->shared)
+            ibdwt_team_square_all(session->team, multiplier, subtrahend);
+        else
+            ibdwt_square(t, multiplier, subtrahend);
+        i++;
+
+        if (t->max_error > IBDWT_MAX_ERROR) {
+            memcpy(t->digits, session->snapshot, t->n * sizeof(double));
+            ibdwt_get_limbs(t, session->mod, s);
+            size_t n = t->n * 2;
+            ibdwt_session_clear(session);
+            ibdwt_session_setup(session, n);
+            ibdwt_set_limbs(t, s, session->mod->n);
+            memcpy(session->snapshot, t->digits, t->n * sizeof(double));
+            i = snapshot_iteration;
+            continue;
+        }
+
+        if (i % IBDWT_SNAPSHOT_INTERVAL == 0) {
+            memcpy(session->snapshot, t->digits, t->n * sizeof(double));
+            snapshot_iteration = i;
+        }
+    }
+}
+
+// rp = ap * bp for reduced residues of the session's modulus, limbs in and out; rp may alias
+// either input. Runs on the calling thread alone, and like ibdwt_session_iterate goes one FFT
+// length up for good when round-off gets too large.
+static inline void ibdwt_session_mul(ibdwt_session_t* session, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp) {
+    ibdwt_session_sync(session);
+    session->resident = NULL;
+    for (;;) {
+        ibdwt_t* t = &session->t;
+        if (session->mul_re == NULL) {
+            session->mul_re = ibdwt_alloc_doubles(t->m);
+            session->mul_im = ibdwt_alloc_doubles(t->m);
+        }
+        ibdwt_set_limbs(t, bp, session->mod->n);
+        ibdwt_forward(t);
+        memcpy(session->mul_re, t->re, t->m * sizeof(double));
+        memcpy(session->mul_im, t->im, t->m * sizeof(double));
+
+        ibdwt_set_limbs(t, ap, session->mod->n);
+        t->max_error = 0.0;
+        ibdwt_mul(t, session->mul_re, session->mul_im);
+        if (t->max_error <= IBDWT_MAX_ERROR) {
+            ibdwt_get_limbs(t, session->mod, rp);
+            return;
+        }
+
+        size_t n = t->n * 2;
+        ibdwt_session_clear(session);
+        ibdwt_session_setup(session, n);
+    }
+}
+
+// One-off ibdwt_session_iterate on s, limbs in and out
+static inline void ibdwt_iterate(special_mod_t* mod, mp_limb_t* s, unsigned long iterations, long multiplier, long subtrahend,
+                                 ibdwt_team_t* team) {
+    ibdwt_session_t session;
+    ibdwt_session_init(&session, mod, team);
+    ibdwt_session_iterate(&session, s, iterations, multiplier, subtrahend);
+    ibdwt_session_sync(&session);
+    ibdwt_session_clear(&session);
+}
+
+static inline double ibdwt_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Time one squaring of a residue of about p bits with the GMP kernel and with the IBDWT
+static inline void ibdwt_time_squarings(unsigned long p, double* gmp_time, double* fft_time) {
+    special_mod_t mod;
+    special_mod_init(&mod, p, 1);
+    mp_limb_t* s = special_mod_alloc(&mod);
+    memset(s, 0x5a, mod.n * sizeof(mp_limb_t));
+    special_mod_reduce(&mod, s, s, mod.n);
+
+    ibdwt_t t;
+    ibdwt_init(&t, p, ibdwt_choose_length(p));
+    ibdwt_set_limbs(&t, s, mod.n);
+
+    int reps = p < (1UL << 18) ? 32 : 4;
+    double start = ibdwt_now();
+    for (int i = 0; i < reps; i++)
+        special_mod_sqr(&mod, s, s);
+    *gmp_time = (ibdwt_now() - start) / reps;
+
+    start = ibdwt_now();
+    for (int i = 0; i < reps; i++)
+        ibdwt_square(&t, 1, 0);
+    *fft_time = (ibdwt_now() - start) / reps;
+
+    ibdwt_clear(&t);
+    free(s);
+    special_mod_clear(&mod);
+}
+
+// Smallest power of two from which the IBDWT squaring beats the GMP kernel on this host,
+// at that size and the next. Returns ULONG_MAX if the FFT never pulls ahead.
+static inline unsigned long ibdwt_measure_crossover(void) {
+    int ahead = 0;
+    for (unsigned long p = 1UL << 12; p <= 1UL << 24; p *= 2) {
+        double gmp_time, fft_time;
+        ibdwt_time_squarings(p + 1, &gmp_time, &fft_time);
+        if (fft_time < gmp_time) {
+            if (++ahead == 2)
+                return p / 2;
+        } else {
+            ahead = 0;
+        }
+    }
+    return (unsigned long)-1;
+}
+
+#endif
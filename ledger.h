@@ -0,0 +1,327 @@
+// Persistent ledger of what is known about each exponent.
+//
+// ledger.bin is a small header followed by fixed-size records, appended and never rewritten,
+// and mapped into memory. Each record says what happened to 2^p - 1: a factor was found, P-1
+// ran without finding one (with its bounds), a full test proved it composite (with the low
+// 64 bits of the final residue, and which test it was, since LL and PRP residues of the same
+// exponent differ) or prime. A record can also cover a whole range of exponents,
+// for imported lists of work that was finished elsewhere. The header's count is bumped only
+// after a record is written, so a crash mid-append leaves the ledger as it was.
+//
+// An in-memory hash index keeps the strongest record per exponent, so workers can look an
+// exponent up before scheduling it for the cost of a hash probe.
+
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LEDGER_FILE "ledger.bin"
+#define LEDGER_MAGIC 0x4744454cU    // "LEDG"
+#define LEDGER_GROW 4096            // records added to the file each time it fills up
+
+// What a record says about 2^p - 1, weakest first
+#define LEDGER_PM1_DONE 1           // P-1 to b1, b2 found nothing
+#define LEDGER_FACTORED 2           // a factor is known
+#define LEDGER_COMPOSITE 3          // a full test said composite, res64 is its residue
+#define LEDGER_PRIME 4
+
+// Which full test a composite or prime record came from
+#define LEDGER_ENGINE_UNKNOWN 0     // no full test ran, or an import didn't say
+#define LEDGER_ENGINE_LUCAS_LEHMER 1
+#define LEDGER_ENGINE_PRP 2
+#define LEDGER_ENGINE_MILLER_RABIN 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t count;                 // records written so far
+} ledger_header_t;
+
+typedef struct {
+    uint64_t exponent;
+    uint64_t last_exponent;         // same as exponent, or the end of an imported range
+    uint32_t status;
+    uint32_t tf_bits;               // trial factoring depth, 0 if unknown
+    uint64_t b1;                    // P-1 bounds, 0 if P-1 did not run
+    uint64_t b2;
+    uint64_t res64;
+    uint32_t engine;                // LEDGER_ENGINE_* that produced status and res64
+    uint32_t reserved;
+    int64_t timestamp;
+} ledger_record_t;
+
+typedef struct {
+    pthread_rwlock_t lock;          // readers look up, writers append and grow
+    int fd;
+    ledger_header_t* map;           // header, then capacity records
+    size_t capacity;
+    uint64_t* keys;                 // open addressing, 0 marks an empty slot
+    uint32_t* slots;                // record index of the strongest record for the key
+    size_t index_size;              // a power of two
+    size_t index_count;
+    uint64_t* ranges;               // start, end pairs of range records
+    size_t range_count;
+} ledger_t;
+
+static inline ledger_record_t* ledger_records(const ledger_t* ledger) {
+    return (ledger_record_t*)(ledger->map + 1);
+}
+
+static inline size_t ledger_hash(uint64_t p, size_t size) {
+    return (size_t)((p * 0x9e3779b97f4a7c15ULL) >> 20) & (size - 1);
+}
+
+// Nonzero if record a tells more than record b
+static inline int ledger_stronger(const ledger_record_t* a, const ledger_record_t* b) {
+    if (a->status != b->status)
+        return a->status > b->status;
+    return a->b2 > b->b2 || a->tf_bits > b->tf_bits;
+}
+
+static inline void ledger_index_insert(ledger_t* ledger, uint32_t record) {
+    if (2 * (ledger->index_count + 1) > ledger->index_size) {
+        size_t old_size = ledger->index_size;
+        uint64_t* old_keys = ledger->keys;
+        uint32_t* old_slots = ledger->slots;
+        ledger->index_size = old_size ? old_size * 2 : 1024;
+        ledger->keys = (uint64_t*)calloc(ledger->index_size, sizeof(uint64_t));
+        ledger->slots = (uint32_t*)calloc(ledger->index_size, sizeof(uint32_t));
+        ledger->index_count = 0;
+        for (size_t i = 0; i < old_size; i++)
+            if (old_keys[i] != 0)
+                ledger_index_insert(ledger, old_slots[i]);
+        free(old_keys);
+        free(old_slots);
+    }
+
+    const ledger_record_t* records = ledger_records(ledger);
+    uint64_t p = records[record].exponent;
+    size_t i = ledger_hash(p, ledger->index_size);
+    while (ledger->keys[i] != 0 && ledger->keys[i] != p)
+        i = (i + 1) & (ledger->index_size - 1);
+    if (ledger->keys[i] == 0) {
+        ledger->keys[i] = p;
+        ledger->slots[i] = record;
+        ledger->index_count++;
+    } else if (ledger_stronger(&records[record], &records[ledger->slots[i]])) {
+        ledger->slots[i] = record;
+    }
+}
+
+static inline void ledger_add_range(ledger_t* ledger, uint64_t start, uint64_t end) {
+    ledger->ranges = (uint64_t*)realloc(ledger->ranges, 2 * (ledger->range_count + 1) * sizeof(uint64_t));
+    size_t i = ledger->range_count++;
+    while (i > 0 && ledger->ranges[2 * (i - 1)] > start) {
+        ledger->ranges[2 * i] = ledger->ranges[2 * (i - 1)];
+        ledger->ranges[2 * i + 1] = ledger->ranges[2 * (i - 1) + 1];
+        i--;
+    }
+    ledger->ranges[2 * i] = start;
+    ledger->ranges[2 * i + 1] = end;
+}
+
+static inline void ledger_map(ledger_t* ledger, size_t capacity) {
+    size_t bytes = sizeof(ledger_header_t) + capacity * sizeof(ledger_record_t);
+    if (ftruncate(ledger->fd, (off_t)bytes) != 0) {
+        perror("Failed to grow ledger");
+        exit(EXIT_FAILURE);
+    }
+    if (ledger->map != NULL)
+        munmap(ledger->map, sizeof(ledger_header_t) + ledger->capacity * sizeof(ledger_record_t));
+    void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ledger->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map ledger");
+        exit(EXIT_FAILURE);
+    }
+    ledger->map = (ledger_header_t*)map;
+    ledger->capacity = capacity;
+}
+
+// Open (or create) the ledger at path and index everything in it
+static inline void ledger_open(ledger_t* ledger, const char* path) {
+    memset(ledger, 0, sizeof(*ledger));
+    pthread_rwlock_init(&ledger->lock, NULL);
+    ledger->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ledger->fd < 0) {
+        perror("Failed to open ledger");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    fstat(ledger->fd, &st);
+    size_t capacity = 0;
+    if ((size_t)st.st_size > sizeof(ledger_header_t))
+        capacity = ((size_t)st.st_size - sizeof(ledger_header_t)) / sizeof(ledger_record_t);
+    ledger_map(ledger, capacity > 0 ? capacity : LEDGER_GROW);
+
+    if (st.st_size == 0) {
+        ledger->map->magic = LEDGER_MAGIC;
+        ledger->map->record_size = sizeof(ledger_record_t);
+        ledger->map->count = 0;
+    } else if (ledger->map->magic != LEDGER_MAGIC || ledger->map->record_size != sizeof(ledger_record_t)
+               || ledger->map->count > ledger->capacity) {
+        fprintf(stderr, "%s is not a ledger this program can read\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    ledger_record_t* records = ledger_records(ledger);
+    for (uint32_t i = 0; i < ledger->map->count; i++) {
+        if (records[i].last_exponent > records[i].exponent)
+            ledger_add_range(ledger, records[i].exponent, records[i].last_exponent);
+        else
+            ledger_index_insert(ledger, i);
+    }
+}
+
+static inline void ledger_close(ledger_t* ledger) {
+    msync(ledger->map, sizeof(ledger_header_t) + ledger->map->count * sizeof(ledger_record_t), MS_SYNC);
+    munmap(ledger->map, sizeof(ledger_header_t) + ledger->capacity * sizeof(ledger_record_t));
+    close(ledger->fd);
+    free(ledger->keys);
+    free(ledger->slots);
+    free(ledger->ranges);
+    pthread_rwlock_destroy(&ledger->lock);
+}
+
+// Append a record for exponents p..last (last == p for a single exponent)
+static inline void ledger_add(ledger_t* ledger, unsigned long p, unsigned long last, int status, unsigned int tf_bits,
+                       unsigned long b1, unsigned long b2, uint64_t res64, int engine) {
+    pthread_rwlock_wrlock(&ledger->lock);
+    if (ledger->map->count == ledger->capacity)
+        ledger_map(ledger, ledger->capacity + LEDGER_GROW);
+
+    uint32_t index = (uint32_t)ledger->map->count;
+    ledger_record_t* record = &ledger_records(ledger)[index];
+    record->exponent = p;
+    record->last_exponent = last;
+    record->status = (uint32_t)status;
+    record->tf_bits = tf_bits;
+    record->b1 = b1;
+    record->b2 = b2;
+    record->res64 = res64;
+    record->engine = (uint32_t)engine;
+    record->reserved = 0;
+    record->timestamp = (int64_t)time(NULL);
+    __atomic_store_n(&ledger->map->count, index + 1, __ATOMIC_RELEASE);
+
+    if (last > p)
+        ledger_add_range(ledger, p, last);
+    else
+        ledger_index_insert(ledger, index);
+    pthread_rwlock_unlock(&ledger->lock);
+}
+
+// Strongest record for p, copied to out. Returns 0 when the ledger knows nothing about p.
+static inline int ledger_find(ledger_t* ledger, unsigned long p, ledger_record_t* out) {
+    int found = 0;
+    pthread_rwlock_rdlock(&ledger->lock);
+    if (ledger->index_size != 0) {
+        size_t i = ledger_hash(p, ledger->index_size);
+        while (ledger->keys[i] != 0 && ledger->keys[i] != p)
+            i = (i + 1) & (ledger->index_size - 1);
+        if (ledger->keys[i] == p) {
+            *out = ledger_records(ledger)[ledger->slots[i]];
+            found = 1;
+        }
+    }
+
+    // Ranges only come from imports, so there are few of them
+    for (size_t i = 0; i < ledger->range_count && !found && ledger->ranges[2 * i] <= p; i++) {
+        if (ledger->ranges[2 * i] <= p && p <= ledger->ranges[2 * i + 1]) {
+            memset(out, 0, sizeof(*out));
+            out->exponent = p;
+            out->last_exponent = ledger->ranges[2 * i + 1];
+            out->status = LEDGER_COMPOSITE;
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&ledger->lock);
+    return found;
+}
+
+// Nonzero if 2^p - 1 needs no more work: factored, tested composite, or prime
+static inline int ledger_done(ledger_t* ledger, unsigned long p) {
+    ledger_record_t record;
+    return ledger_find(ledger, p, &record) && record.status >= LEDGER_FACTORED;
+}
+
+// LEDGER_ENGINE_* for an engine name in an import file, -1 if it isn't one
+static inline int ledger_parse_engine(const char* name) {
+    if (strcmp(name, "ll") == 0)
+        return LEDGER_ENGINE_LUCAS_LEHMER;
+    if (strcmp(name, "prp") == 0)
+        return LEDGER_ENGINE_PRP;
+    if (strcmp(name, "mr") == 0)
+        return LEDGER_ENGINE_MILLER_RABIN;
+    return -1;
+}
+
+// Add the results listed in a text file. Lines look like
+//   86243 prime [ll|prp|mr]
+//   86249 composite [res64 in hex [ll|prp|mr]]
+//   86251 factored
+//   100003 pm1 <B1> <B2>
+//   1000-50000 composite          (every exponent in the range)
+//   100003 <B1> <B2> <factor>     (a line of pm1_results.txt, factor 0 for none)
+// Blank lines and lines starting with # are skipped. Returns the number of records added.
+static inline size_t ledger_import(ledger_t* ledger, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open import file");
+        return 0;
+    }
+
+    size_t added = 0;
+    char line[4096];
+    unsigned long line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        unsigned long p, last, b1, b2;
+        char word[32], engine_name[32], factor[4000];
+        unsigned long long res64 = 0;
+        int engine = LEDGER_ENGINE_UNKNOWN;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+            continue;
+
+        if (sscanf(line, "%lu %lu %lu %3999s", &p, &b1, &b2, factor) == 4) {
+            int factored = strcmp(factor, "0") != 0;
+            ledger_add(ledger, p, p, factored ? LEDGER_FACTORED : LEDGER_PM1_DONE, 0, b1, b2, 0, LEDGER_ENGINE_UNKNOWN);
+        } else if (sscanf(line, "%lu-%lu %31s", &p, &last, word) == 3 && last >= p
+                   && (strcmp(word, "composite") == 0 || strcmp(word, "factored") == 0)) {
+            ledger_add(ledger, p, last, LEDGER_COMPOSITE, 0, 0, 0, 0, LEDGER_ENGINE_UNKNOWN);
+        } else if (sscanf(line, "%lu %31s", &p, word) == 2) {
+            if (strcmp(word, "prime") == 0 && (sscanf(line, "%*u %*s %31s", engine_name) != 1
+                                               || (engine = ledger_parse_engine(engine_name)) >= 0)) {
+                ledger_add(ledger, p, p, LEDGER_PRIME, 0, 0, 0, 0, engine);
+            } else if (strcmp(word, "composite") == 0 && (sscanf(line, "%*u %*s %llx %31s", &res64, engine_name) != 2
+                                                          || (engine = ledger_parse_engine(engine_name)) >= 0)) {
+                ledger_add(ledger, p, p, LEDGER_COMPOSITE, 0, 0, 0, res64, engine);
+            } else if (strcmp(word, "factored") == 0) {
+                ledger_add(ledger, p, p, LEDGER_FACTORED, 0, 0, 0, 0, LEDGER_ENGINE_UNKNOWN);
+            } else if (strcmp(word, "pm1") == 0 && sscanf(line, "%*u %*s %lu %lu", &b1, &b2) == 2) {
+                ledger_add(ledger, p, p, LEDGER_PM1_DONE, 0, b1, b2, 0, LEDGER_ENGINE_UNKNOWN);
+            } else {
+                fprintf(stderr, "%s:%lu: can't parse '%s'\n", path, line_number, strtok(line, "\r\n"));
+                continue;
+            }
+        } else {
+            fprintf(stderr, "%s:%lu: can't parse '%s'\n", path, line_number, strtok(line, "\r\n"));
+            continue;
+        }
+        added++;
+    }
+    fclose(file);
+    return added;
+}
+
+#endif
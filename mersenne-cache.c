@@ -9,9 +9,25 @@
 #include <time.h>
 #include <getopt.h>
 
+#include "exponent-sieve.h"
+#include "work-queue.h"
+#include "checkpoint.h"
+#include "ledger.h"
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+#include "primality.h"
+#include "gmp-alloc.h"
+#include "prp-proof.h"
+#include "mersenne-test.h"
+#include "trial-factor.h"
+#include "progress.h"
+#include "metrics.h"
+#include "result-writer.h"
+#include "radix-convert.h"
+#include "admission.h"
+
 #define MAX_THREADS 64
-#define MILLER_RABIN_ITERATIONS 40
-#define UPDATE_INTERVAL 1000 // Update status every 1000 checks
+#define STATUS_INTERVAL 1.0 // Seconds between status lines
 #define CACHE_FILE "candidate_cache.txt"
 
 // ANSI color codes
@@ -24,135 +40,162 @@
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
 typedef struct {
-    mpz_t start;
-    mpz_t step;
+    work_queue_t* queue;
     int thread_id;
 } thread_data_t;
 
 volatile sig_atomic_t keep_running = 1;
-pthread_mutex_t prime_mutex = PTHREAD_MUTEX_INITIALIZER;
-mpz_t current_prime;
-unsigned long long current_n;
+result_writer_t result_writer;
+unsigned long long best_exponent;   // largest exponent found to give a prime
+unsigned long long current_n;       // the last one found
+FILE* cache_file;
 int num_threads;
-unsigned long long primes_checked = 0;
-time_t start_time;
-
-void print_status(void);
+metrics_t metrics;
+progress_t progress;
+exponent_stream_t exponents;
+work_queue_t queue;
+checkpoint_list_t resume_list;
+ledger_t ledger;
+int output_format = RADIX_DECIMAL;  // how found primes are written out
+int conversion_threads = 1;
+admission_t admission;  // memory budget shared by every running test
+mersenne_test_config_t test_config;  // engine, crossover, checkpoints, proofs and teams
+work_gate_t team_gate;  // lets one worker at a time lead a team test
 
 void handle_sigint(int sig) {
     keep_running = 0;
 }
 
-int miller_rabin(mpz_t n, int iterations) {
-    if (mpz_cmp_ui(n, 2) < 0)
-        return 0;
-    if (mpz_cmp_ui(n, 2) == 0)
-        return 1;
-    if (mpz_even_p(n))
-        return 0;
-
-    mpz_t a, y, j, r, n_minus_one;
-    mpz_inits(a, y, j, r, n_minus_one, NULL);
-
-    unsigned long int s = 0;
-    mpz_sub_ui(n_minus_one, n, 1);
-    mpz_set(r, n_minus_one);
-
-    while (mpz_even_p(r)) {
-        mpz_fdiv_q_2exp(r, r, 1);
-        s++;
-    }
-
-    gmp_randstate_t rnd;
-    gmp_randinit_default(rnd);
-    gmp_randseed_ui(rnd, time(NULL));
-
-    int is_prime = 1;
-    for (int i = 0; i < iterations && is_prime; i++) {
-        mpz_urandomm(a, rnd, n_minus_one);
-        mpz_add_ui(a, a, 1);
-        mpz_powm(y, a, r, n);
-
-        if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_one) != 0) {
-            for (unsigned long int j = 1; j < s && mpz_cmp(y, n_minus_one) != 0; j++) {
-                mpz_powm_ui(y, y, 2, n);
-                if (mpz_cmp_ui(y, 1) == 0) {
-                    is_prime = 0;
-                    break;
-                }
-            }
-            if (mpz_cmp(y, n_minus_one) != 0) {
-                is_prime = 0;
-            }
-        }
-    }
-
-    mpz_clears(a, y, j, r, n_minus_one, NULL);
-    gmp_randclear(rnd);
-    return is_prime;
-}
-
 void* find_mersenne_primes(void* arg) {
     thread_data_t* data = (thread_data_t*)arg;
-    mpz_t candidate, mersenne;
-    mpz_inits(candidate, mersenne, NULL);
-    mpz_set(candidate, data->start);
-
-    FILE *cache_file = fopen(CACHE_FILE, "a+");
-    if (!cache_file) {
-        perror("Failed to open cache file");
-        pthread_exit(NULL);
-    }
+    primality_ctx_t ctx;
+    primality_ctx_init(&ctx, data->thread_id);
 
     while (keep_running) {
-        mpz_ui_pow_ui(mersenne, 2, mpz_get_ui(candidate));
-        mpz_sub_ui(mersenne, mersenne, 1);
-
-        if (miller_rabin(mersenne, MILLER_RABIN_ITERATIONS)) {
-            pthread_mutex_lock(&prime_mutex);
-            if (mpz_cmp(candidate, current_prime) > 0) {
-                mpz_set(current_prime, candidate);
-                current_n = mpz_get_ui(candidate);
-                printf(ANSI_COLOR_GREEN "\nFound Mersenne prime: 2^%llu - 1\n" ANSI_COLOR_RESET, current_n);
-                mpz_out_str(stdout, 10, mersenne);
-                printf("\n");
-
-                mpz_out_str(cache_file, 10, candidate);
-                fprintf(cache_file, "\n");
-                fflush(cache_file);
-            }
-            pthread_mutex_unlock(&prime_mutex);
+        int resumed;
+        unsigned long p = mersenne_next_exponent(&resume_list, data->queue, &ledger, &progress, data->thread_id, &resumed);
+        if (p == 0)
+            break;
+        tf_factor_t factor;
+        unsigned int tf_bits = trial_factor_bits(p, test_config.fft_crossover);
+
+        if (!resumed && trial_factor(p, tf_bits, &factor)) {
+            ledger_add(&ledger, p, p, LEDGER_FACTORED, tf_bits, 0, 0, 0, LEDGER_ENGINE_UNKNOWN);
+            progress_add(&progress, data->thread_id, PROGRESS_TRIAL_FACTORED, 1);
+            progress_add(&progress, data->thread_id, PROGRESS_CHECKED, 1);
+            continue;
         }
 
-        mpz_add(candidate, candidate, data->step);
-        __sync_fetch_and_add(&primes_checked, 1);
-
-        if (primes_checked % UPDATE_INTERVAL == 0) {
-            print_status();
+        primality_set_mersenne(&ctx, p);
+
+        uint64_t res64;
+        int result = mersenne_run_test(&test_config, &ctx, &team_gate, num_threads, NULL, p, &res64);
+        if (result < 0)
+            break;
+        progress_add(&progress, data->thread_id, PROGRESS_FULL_TESTS, 1);
+        ledger_add(&ledger, p, p, result ? LEDGER_PRIME : LEDGER_COMPOSITE, resumed ? 0 : tf_bits, 0, 0, res64,
+                   mersenne_ledger_engine(&test_config));
+        if (result) {
+            // Work is handed out out of order, so report every find and keep the largest
+            result_writer_max(&best_exponent, p);
+            __atomic_store_n(&current_n, p, __ATOMIC_RELAXED);
+            result_t found = {p, data->thread_id};
+            result_writer_push(&result_writer, &found);
         }
+
+        progress_add(&progress, data->thread_id, PROGRESS_CHECKED, 1);
     }
 
-    fclose(cache_file);
-    mpz_clears(candidate, mersenne, NULL);
+    work_gate_retire(&team_gate);
+    primality_ctx_clear(&ctx);
     return NULL;
 }
 
-void print_status(void) {
-    time_t current_time = time(NULL);
-    double elapsed_time = difftime(current_time, start_time);
+// Runs on the result writer thread, so converting a big prime never holds up a worker
+void write_result(const result_t* result) {
+    mpz_t mersenne;
+    mpz_init(mersenne);
+    mpz_setbit(mersenne, result->exponent);
+    mpz_sub_ui(mersenne, mersenne, 1);
+    printf(ANSI_COLOR_GREEN "\nFound Mersenne prime: 2^%lu - 1\n" ANSI_COLOR_RESET, result->exponent);
+    if (output_format == RADIX_BINARY) {
+        char path[64];
+        snprintf(path, sizeof(path), "M%lu.bin", result->exponent);
+        if (radix_write_file(path, mersenne, RADIX_BINARY, conversion_threads) == 0)
+            printf("Written to %s\n", path);
+    } else {
+        radix_print(stdout, mersenne, output_format, conversion_threads);
+        printf("\n");
+    }
+    fflush(stdout);
+    mpz_clear(mersenne);
+
+    fprintf(cache_file, "%lu\n", result->exponent);
+    if (fflush(cache_file) != 0 || fsync(fileno(cache_file)) != 0)
+        perror("Failed to write cache file");
+}
+
+// Runs on the status thread
+void print_status(progress_t* progress) {
+    double elapsed_time = progress_elapsed(progress);
+    unsigned long long primes_checked = progress_total(progress, PROGRESS_CHECKED);
     double primes_per_second = primes_checked / elapsed_time;
 
-    printf(ANSI_COLOR_CYAN "\rCurrent n: %llu | " ANSI_COLOR_YELLOW "Primes checked: %llu | " ANSI_COLOR_GREEN "%.2f primes/second" ANSI_COLOR_RESET, 
-           current_n, primes_checked, primes_per_second);
+    printf(ANSI_COLOR_CYAN "\rCurrent n: %lu | " ANSI_COLOR_YELLOW "Primes checked: %llu | " ANSI_COLOR_GREEN "%.2f primes/second" ANSI_COLOR_RESET
+           " | Eliminated: %llu sieve, %llu trial factoring, %llu ledger | Full tests: %llu",
+           work_queue_frontier(&queue), primes_checked, primes_per_second, exponent_stream_filtered(&exponents),
+           progress_total(progress, PROGRESS_TRIAL_FACTORED), progress_total(progress, PROGRESS_LEDGER),
+           progress_total(progress, PROGRESS_FULL_TESTS));
+    gmp_alloc_stats_t gmp_stats;
+    gmp_alloc_get_stats(&gmp_stats);
+    printf(" | GMP: %.1f MB live, %.1f MB peak, %.0f allocs/s",
+           gmp_stats.live / 1048576.0, gmp_stats.peak / 1048576.0, gmp_stats.allocations / elapsed_time);
+    int waiting;
+    size_t reserved = admission_reserved(&admission, &waiting);
+    printf(" | Memory: %.0f/%.0f MB reserved, %d waiting, %.1f MB peak RSS",
+           reserved / 1048576.0, admission.budget / 1048576.0, waiting, admission_peak_resident() / 1048576.0);
     fflush(stdout);
 }
 
+// Prometheus metrics for -M; runs on the metrics thread
+void write_metrics(metrics_t* metrics, FILE* out) {
+    progress_t* progress = metrics->progress;
+    metrics_write_progress(metrics, out, "mersenne");
+    metrics_gauge(out, "mersenne_frontier_exponent", "Lowest exponent not yet handed to a worker", work_queue_frontier(&queue));
+    metrics_gauge(out, "mersenne_last_prime_exponent", "Exponent of the last Mersenne prime found, the starting exponent until one is", __atomic_load_n(&current_n, __ATOMIC_RELAXED));
+    metrics_gauge(out, "mersenne_largest_prime_exponent", "Largest exponent found to give a Mersenne prime, 0 until one is", __atomic_load_n(&best_exponent, __ATOMIC_RELAXED));
+    metrics_family(out, "mersenne_eliminated_total", "counter", "Exponents settled without a full test, by stage");
+    fprintf(out, "mersenne_eliminated_total{stage=\"sieve\"} %llu\n", exponent_stream_filtered(&exponents));
+    fprintf(out, "mersenne_eliminated_total{stage=\"trial_factoring\"} %llu\n", progress_total(progress, PROGRESS_TRIAL_FACTORED));
+    fprintf(out, "mersenne_eliminated_total{stage=\"ledger\"} %llu\n", progress_total(progress, PROGRESS_LEDGER));
+    metrics_counter(out, "mersenne_full_tests_total", "Exponents given a full primality test", progress_total(progress, PROGRESS_FULL_TESTS));
+    double age = checkpoint_age();
+    metrics_gauge(out, "mersenne_checkpoint_age_seconds", "Seconds since the last checkpoint was saved", age < 0 ? NAN : age);
+    gmp_alloc_stats_t gmp_stats;
+    gmp_alloc_get_stats(&gmp_stats);
+    metrics_gauge(out, "mersenne_gmp_live_bytes", "Bytes GMP has allocated and not freed", gmp_stats.live);
+    metrics_gauge(out, "mersenne_gmp_peak_bytes", "Most bytes GMP has had allocated at once", gmp_stats.peak);
+    metrics_gauge(out, "mersenne_gmp_mapped_bytes", "Bytes the GMP allocator has mapped from the system", gmp_stats.mapped);
+    int waiting;
+    size_t reserved = admission_reserved(&admission, &waiting);
+    metrics_gauge(out, "mersenne_memory_budget_bytes", "Bytes the running tests may reserve together", admission.budget);
+    metrics_gauge(out, "mersenne_memory_reserved_bytes", "Bytes reserved by the running tests", reserved);
+    metrics_gauge(out, "mersenne_memory_waiting_workers", "Workers waiting for room in the memory budget", waiting);
+    metrics_gauge(out, "mersenne_peak_resident_bytes", "Highest resident memory of the process", admission_peak_resident());
+}
+
 int main(int argc, char* argv[]) {
+    gmp_alloc_install();
+    mersenne_test_config_init(&test_config, &keep_running, &admission);
     num_threads = 1;
     unsigned long long initial_n = 3;
+    unsigned long long final_n = 0;
+    const char* import_path = NULL;
+    const char* metrics_address = NULL;
+    size_t memory_budget = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "t:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "t:i:e:x:n:c:P:I:M:f:T:m:")) != -1) {
         switch (opt) {
             case 't':
                 num_threads = atoi(optarg);
@@ -160,8 +203,46 @@ int main(int argc, char* argv[]) {
             case 'i':
                 initial_n = strtoull(optarg, NULL, 10);
                 break;
+            case 'c':
+                test_config.checkpoint_interval = atof(optarg);
+                break;
+            case 'I':
+                import_path = optarg;
+                break;
+            case 'M':
+                metrics_address = optarg;
+                break;
+            case 'f':
+                output_format = radix_parse_format(optarg);
+                if (output_format < 0) {
+                    fprintf(stderr, "Unknown output format '%s' (expected dec, hex or bin)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                test_config.proof_budget = (size_t)(atof(optarg) * 1024 * 1024);
+                break;
+            case 'n':
+                final_n = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                test_config.engine = mersenne_parse_engine(optarg);
+                if (test_config.engine < 0) {
+                    fprintf(stderr, "Unknown engine '%s' (expected ll, mr or prp)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'x':
+                test_config.fft_crossover = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                test_config.team_exponent = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                memory_budget = (size_t)(atof(optarg) * 1024 * 1024);
+                break;
             default:
-                fprintf(stderr, "Usage: %s -t <num_threads> -i <initial_n>\n", argv[0]);
+                fprintf(stderr, "Usage: %s -t <num_threads> -i <initial_n> [-n <final_n>] [-e ll|mr|prp] [-x <fft_crossover>] [-T <team_exponent>] [-m <memory_megabytes>] [-c <checkpoint_seconds>] [-P <proof_megabytes>] [-I <known_results_file>] [-M <port>|unix:<path>] [-f dec|hex|bin]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -171,22 +252,49 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    mpz_init(current_prime);
-    mpz_set_ui(current_prime, initial_n);
+    conversion_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (test_config.fft_crossover == 0)
+        test_config.fft_crossover = ibdwt_measure_crossover();
+    printf("IBDWT squaring from p = %lu\n", test_config.fft_crossover);
+    const char* budget_source;
+    admission_init(&admission, memory_budget, &budget_source);
+    printf("Memory budget: %.0f MB (%s)\n", admission.budget / 1048576.0, budget_source);
+
+    best_exponent = 0;
     current_n = initial_n;
 
+    cache_file = fopen(CACHE_FILE, "a");
+    if (cache_file == NULL) {
+        perror("Failed to open cache file");
+        exit(EXIT_FAILURE);
+    }
+
     signal(SIGINT, handle_sigint);
 
+    ledger_open(&ledger, LEDGER_FILE);
+    if (import_path != NULL)
+        printf("Imported %zu known results from %s\n", ledger_import(&ledger, import_path), import_path);
+
     pthread_t threads[MAX_THREADS];
     thread_data_t thread_data[MAX_THREADS];
-
-    start_time = time(NULL);
+    exponent_stream_init(&exponents, initial_n, final_n);
+    checkpoint_list_load(&resume_list, mersenne_checkpoint_kind(&test_config));
+    if (resume_list.count > 0)
+        printf("Resuming %zu checkpointed tests\n", resume_list.count);
+    work_queue_init(&queue, &exponents, num_threads);
+    work_gate_init(&team_gate, num_threads);
+
+    result_writer_init(&result_writer, write_result);
+    result_writer_start(&result_writer);
+    progress_init(&progress, num_threads, STATUS_INTERVAL);
+    progress_start(&progress, print_status);
+    if (metrics_address != NULL) {
+        metrics_open(&metrics, metrics_address, &progress, write_metrics);
+        metrics_start(&metrics);
+    }
 
     for (int i = 0; i < num_threads; i++) {
-        mpz_init(thread_data[i].start);
-        mpz_init(thread_data[i].step);
-        mpz_set_ui(thread_data[i].start, initial_n + i);
-        mpz_set_ui(thread_data[i].step, num_threads);
+        thread_data[i].queue = &queue;
         thread_data[i].thread_id = i;
 
         if (pthread_create(&threads[i], NULL, find_mersenne_primes, &thread_data[i]) != 0) {
@@ -198,15 +306,21 @@ int main(int argc, char* argv[]) {
     for (int i = 0; i < num_threads; i++) {
         pthread_join(threads[i], NULL);
     }
+    result_writer_stop(&result_writer);
+    progress_stop(&progress);
+    if (metrics_address != NULL)
+        metrics_close(&metrics);
 
     printf("\n\nSearch completed.\n");
 
-    for (int i = 0; i < num_threads; i++) {
-        mpz_clear(thread_data[i].start);
-        mpz_clear(thread_data[i].step);
-    }
-
-    mpz_clear(current_prime);
+    work_queue_clear(&queue);
+    work_gate_clear(&team_gate);
+    checkpoint_list_clear(&resume_list);
+    exponent_stream_clear(&exponents);
+    ledger_close(&ledger);
+    progress_clear(&progress);
+    admission_clear(&admission);
+    fclose(cache_file);
 
     return 0;
 }
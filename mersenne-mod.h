@@ -0,0 +1,225 @@
+// Arithmetic modulo N = 2^p - c for small c (c = 1 is 2^p - 1, a negative c is 2^p + |c|).
+//
+// For these moduli there is no need for a division or a Montgomery step: writing a
+// product as x = hi * 2^p + lo gives x = lo + c * hi (mod N), which is a shift, a
+// single-limb multiply and an add. A squaring is one mpn_sqr followed by two or three
+// of those folds, all on raw GMP limbs with buffers set up once per modulus.
+//
+// Residues are kept fully reduced in special_mod_t.n limbs, so 0 is always all-zero limbs.
+// The folds only shrink the value while |c| < 2^(p-1), which is the intended use.
+
+#ifndef MERSENNE_MOD_H
+#define MERSENNE_MOD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+typedef struct {
+    unsigned long p;
+    long c;                 // the modulus is 2^p - c
+    mp_size_t n;            // limbs in a reduced residue
+    mp_limb_t* modulus;     // N itself, n limbs
+    mp_limb_t* minus_one;   // N - 1, n limbs
+    mp_limb_t* product;     // 2n + 2 limbs for a full product being folded
+    mp_limb_t* high;        // 2n + 2 limbs for the part above bit p
+} special_mod_t;
+
+static inline mp_size_t special_mod_normalize(const mp_limb_t* xp, mp_size_t xn) {
+    while (xn > 0 && xp[xn - 1] == 0)
+        xn--;
+    return xn;
+}
+
+static inline void special_mod_init(special_mod_t* mod, unsigned long p, long c) {
+    mod->p = p;
+    mod->c = c;
+    // 2^p + |c| needs bit p itself
+    unsigned long bits = c >= 0 ? p : p + 1;
+    mod->n = (mp_size_t)((bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+    mod->modulus = (mp_limb_t*)calloc(mod->n + 1, sizeof(mp_limb_t));
+    mod->product = (mp_limb_t*)calloc(2 * mod->n + 2, sizeof(mp_limb_t));
+    mod->high = (mp_limb_t*)calloc(2 * mod->n + 2, sizeof(mp_limb_t));
+
+    // N = 2^p - c
+    mpz_t value;
+    mpz_init(value);
+    mpz_setbit(value, p);
+    if (c >= 0)
+        mpz_sub_ui(value, value, (unsigned long)c);
+    else
+        mpz_add_ui(value, value, (unsigned long)-c);
+    mpz_export(mod->modulus, NULL, -1, sizeof(mp_limb_t), 0, 0, value);
+    mod->minus_one = (mp_limb_t*)calloc(mod->n + 1, sizeof(mp_limb_t));
+    mpz_sub_ui(value, value, 1);
+    mpz_export(mod->minus_one, NULL, -1, sizeof(mp_limb_t), 0, 0, value);
+    mpz_clear(value);
+}
+
+static inline void special_mod_clear(special_mod_t* mod) {
+    free(mod->modulus);
+    free(mod->minus_one);
+    free(mod->product);
+    free(mod->high);
+}
+
+static inline mp_limb_t* special_mod_alloc(const special_mod_t* mod) {
+    return (mp_limb_t*)calloc(mod->n, sizeof(mp_limb_t));
+}
+
+// Nonzero when x = xp[0..xn) has bits at or above bit p
+static inline int special_mod_has_high(const special_mod_t* mod, const mp_limb_t* xp, mp_size_t xn) {
+    mp_size_t q = (mp_size_t)(mod->p / GMP_NUMB_BITS);
+    unsigned int b = (unsigned int)(mod->p % GMP_NUMB_BITS);
+    if (xn > q + 1)
+        return 1;
+    if (xn <= q)
+        return 0;
+    return b == 0 || (xp[q] >> b) != 0;
+}
+
+// rp = xp[0..xn) mod N, where xn <= 2n + 1. xp is used as scratch and may be mod->product.
+static inline void special_mod_reduce(special_mod_t* mod, mp_limb_t* rp, mp_limb_t* xp, mp_size_t xn) {
+    mp_size_t q = (mp_size_t)(mod->p / GMP_NUMB_BITS);
+    unsigned int b = (unsigned int)(mod->p % GMP_NUMB_BITS);
+    mp_limb_t* hp = mod->high;
+    mp_limb_t c = mod->c >= 0 ? (mp_limb_t)mod->c : (mp_limb_t)-mod->c;
+    int negative = 0;   // the true residue is -x rather than x
+
+    xn = special_mod_normalize(xp, xn);
+    while (special_mod_has_high(mod, xp, xn)) {
+        // Split x = hi * 2^p + lo
+        mp_size_t hn = xn - q;
+        if (b != 0)
+            mpn_rshift(hp, xp + q, hn, b);
+        else
+            memcpy(hp, xp + q, hn * sizeof(mp_limb_t));
+        hn = special_mod_normalize(hp, hn);
+
+        if (b != 0) {
+            xp[q] &= ((mp_limb_t)1 << b) - 1;
+            xn = special_mod_normalize(xp, q + 1);
+        } else {
+            xn = special_mod_normalize(xp, q);
+        }
+
+        if (c != 1) {
+            mp_limb_t carry = mpn_mul_1(hp, hp, hn, c);
+            if (carry)
+                hp[hn++] = carry;
+        }
+
+        if (xn == 0) {
+            // x = (+-) c * hi
+            memcpy(xp, hp, hn * sizeof(mp_limb_t));
+            xn = hn;
+            if (mod->c < 0)
+                negative = !negative;
+        } else if (mod->c >= 0) {
+            // x = lo + c * hi
+            mp_limb_t carry = xn >= hn ? mpn_add(xp, xp, xn, hp, hn) : mpn_add(xp, hp, hn, xp, xn);
+            xn = xn >= hn ? xn : hn;
+            if (carry)
+                xp[xn++] = carry;
+        } else if (xn > hn || (xn == hn && mpn_cmp(xp, hp, xn) >= 0)) {
+            // x = lo - |c| * hi
+            mpn_sub(xp, xp, xn, hp, hn);
+            xn = special_mod_normalize(xp, xn);
+        } else {
+            // |c| * hi dominates: keep |c| * hi - lo and flip the sign
+            mpn_sub(xp, hp, hn, xp, xn);
+            xn = special_mod_normalize(xp, hn);
+            negative = !negative;
+        }
+    }
+
+    // Now x < 2^p; bring it below N and apply the sign
+    mp_size_t n = mod->n;
+    for (mp_size_t i = xn; i < n; i++)
+        xp[i] = 0;
+    while (mpn_cmp(xp, mod->modulus, n) >= 0)
+        mpn_sub_n(xp, xp, mod->modulus, n);
+    if (negative && special_mod_normalize(xp, n) != 0)
+        mpn_sub_n(xp, mod->modulus, xp, n);
+    if (rp != xp)
+        memcpy(rp, xp, n * sizeof(mp_limb_t));
+}
+
+// rp = ap^2 mod N; rp may alias ap
+static inline void special_mod_sqr(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap) {
+    mp_size_t n = mod->n;
+    mpn_sqr(mod->product, ap, n);
+    special_mod_reduce(mod, rp, mod->product, 2 * n);
+}
+
+// rp = ap * bp mod N; rp may alias either input
+static inline void special_mod_mul(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp) {
+    mp_size_t n = mod->n;
+    if (ap == bp)
+        mpn_sqr(mod->product, ap, n);
+    else
+        mpn_mul_n(mod->product, ap, bp, n);
+    special_mod_reduce(mod, rp, mod->product, 2 * n);
+}
+
+// rp = ap * v mod N; rp may alias ap
+static inline void special_mod_mul_ui(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap, mp_limb_t v) {
+    mp_size_t n = mod->n;
+    mod->product[n] = mpn_mul_1(mod->product, ap, n, v);
+    special_mod_reduce(mod, rp, mod->product, n + 1);
+}
+
+// rp = ap + bp mod N; rp may alias either input
+static inline void special_mod_add(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp) {
+    mp_limb_t carry = mpn_add_n(rp, ap, bp, mod->n);
+    if (carry || mpn_cmp(rp, mod->modulus, mod->n) >= 0)
+        mpn_sub_n(rp, rp, mod->modulus, mod->n);
+}
+
+// rp = ap - bp mod N; rp may alias either input
+static inline void special_mod_sub(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp) {
+    if (mpn_sub_n(rp, ap, bp, mod->n))
+        mpn_add_n(rp, rp, mod->modulus, mod->n);
+}
+
+// rp = rp - v mod N
+static inline void special_mod_sub_ui(special_mod_t* mod, mp_limb_t* rp, mp_limb_t v) {
+    if (mpn_sub_1(rp, rp, mod->n, v))
+        mpn_add_n(rp, rp, mod->modulus, mod->n);
+}
+
+static inline void special_mod_set_ui(special_mod_t* mod, mp_limb_t* rp, mp_limb_t v) {
+    memset(rp, 0, mod->n * sizeof(mp_limb_t));
+    rp[0] = v;
+    if (mod->n == 1 && mpn_cmp(rp, mod->modulus, 1) >= 0)
+        rp[0] %= mod->modulus[0];
+}
+
+static inline void special_mod_set_mpz(special_mod_t* mod, mp_limb_t* rp, const mpz_t value) {
+    mpz_t reduced, modulus;
+    mpz_init(reduced);
+    mpz_roinit_n(modulus, mod->modulus, special_mod_normalize(mod->modulus, mod->n));
+    mpz_mod(reduced, value, modulus);
+    memset(rp, 0, mod->n * sizeof(mp_limb_t));
+    mpz_export(rp, NULL, -1, sizeof(mp_limb_t), 0, 0, reduced);
+    mpz_clear(reduced);
+}
+
+static inline void special_mod_get_mpz(const special_mod_t* mod, mpz_t value, const mp_limb_t* ap) {
+    mpz_import(value, mod->n, -1, sizeof(mp_limb_t), 0, 0, ap);
+}
+
+static inline int special_mod_is_zero(const special_mod_t* mod, const mp_limb_t* ap) {
+    return special_mod_normalize(ap, mod->n) == 0;
+}
+
+static inline int special_mod_equal_ui(const special_mod_t* mod, const mp_limb_t* ap, mp_limb_t v) {
+    return ap[0] == v && special_mod_normalize(ap + 1, mod->n - 1) == 0;
+}
+
+// ap == N - 1
+static inline int special_mod_is_minus_one(const special_mod_t* mod, const mp_limb_t* ap) {
+    return mpn_cmp(ap, mod->minus_one, mod->n) == 0;
+}
+
+#endif
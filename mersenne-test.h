@@ -0,0 +1,391 @@
+// Full primality tests of 2^p - 1, shared by mersenne.c, mersenne-cache.c and mersenne-intel.c.
+//
+// Lucas-Lehmer is the default and gives an exact answer. The base-3 Fermat PRP test carries a
+// Gerbicz check, so a flipped bit is caught and rolled back instead of giving a wrong answer,
+// and it can leave a Pietrzak proof behind. Miller-Rabin is kept for comparison. The two long
+// tests run in chunks of about a second and save checkpoints between chunks, and all three stop
+// early when the program is asked to quit.
+//
+// A worker runs a test through mersenne_run_test, which holds the test's memory in the
+// admission budget and hands the biggest ones to a team of threads.
+
+#ifndef MERSENNE_TEST_H
+#define MERSENNE_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <gmp.h>
+
+#include "exponent-sieve.h"
+#include "work-queue.h"
+#include "checkpoint.h"
+#include "ledger.h"
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+#include "primality.h"
+#include "prp-proof.h"
+#include "progress.h"
+#include "admission.h"
+
+// Primality engines for 2^p - 1
+#define MERSENNE_ENGINE_LUCAS_LEHMER 0
+#define MERSENNE_ENGINE_MILLER_RABIN 1
+#define MERSENNE_ENGINE_PRP 2
+
+#define MERSENNE_MILLER_RABIN_ITERATIONS 40
+#define MERSENNE_TEAM_EXPONENT 4000000  // from here up one test is shared by a team of workers
+#define PRP_MAX_BLOCK 1000              // cap on iterations per Gerbicz block
+#define PRP_CHECK_BLOCKS 64             // blocks between Gerbicz checks
+#define TEST_RESIDUES 12                // residue-sized buffers a full test holds: special_mod's, its own, M_p, GMP scratch
+
+// How tests are run, set up once from the command line
+typedef struct {
+    int engine;                             // MERSENNE_ENGINE_*
+    unsigned long fft_crossover;            // exponents from here up are squared with the IBDWT engine
+    unsigned long team_exponent;            // 0 keeps every test on one thread
+    double checkpoint_interval;             // seconds between checkpoint saves
+    size_t proof_budget;                    // bytes of proof residues per PRP test, 0 for no proofs
+    const volatile sig_atomic_t* keep_running;  // cleared by Ctrl-C
+    admission_t* admission;                 // memory budget shared by every running test
+} mersenne_test_config_t;
+
+static inline void mersenne_test_config_init(mersenne_test_config_t* config, const volatile sig_atomic_t* keep_running,
+                                             admission_t* admission) {
+    config->engine = MERSENNE_ENGINE_LUCAS_LEHMER;
+    config->fft_crossover = 0;
+    config->team_exponent = MERSENNE_TEAM_EXPONENT;
+    config->checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+    config->proof_budget = 0;
+    config->keep_running = keep_running;
+    config->admission = admission;
+}
+
+// "ll", "mr" or "prp", -1 for anything else
+static inline int mersenne_parse_engine(const char* name) {
+    if (strcmp(name, "ll") == 0)
+        return MERSENNE_ENGINE_LUCAS_LEHMER;
+    if (strcmp(name, "mr") == 0)
+        return MERSENNE_ENGINE_MILLER_RABIN;
+    if (strcmp(name, "prp") == 0)
+        return MERSENNE_ENGINE_PRP;
+    return -1;
+}
+
+// Lucas-Lehmer test: 2^p - 1 is prime iff s_(p-2) == 0, s_0 = 4, s_k = s_(k-1)^2 - 2.
+// Resumes from and periodically saves a checkpoint; returns -1 when stopped by Ctrl-C.
+// res64 gets the low 64 bits of the final residue. team, if not NULL, shares the squarings.
+static inline int mersenne_lucas_lehmer(const mersenne_test_config_t* config, unsigned long p, ibdwt_team_t* team,
+                                        uint64_t* res64) {
+    *res64 = 0;
+    if (p < 2)
+        return 0;
+    if (p == 2)
+        return 1;
+
+    special_mod_t mod;
+    special_mod_init(&mod, p, 1);
+    mp_limb_t* s = special_mod_alloc(&mod);
+    unsigned long i = 0;
+    int checkpointed = checkpoint_load(p, CHECKPOINT_LUCAS_LEHMER, &i, s, mod.n);
+    if (!checkpointed)
+        special_mod_set_ui(&mod, s, 4);
+
+    // Above the crossover s stays in the transform's digits between chunks
+    ibdwt_session_t fft;
+    int use_fft = p >= config->fft_crossover;
+    if (use_fft)
+        ibdwt_session_init(&fft, &mod, team);
+
+    checkpoint_run_t run;
+    checkpoint_run_init(&run, config->checkpoint_interval);
+    while (i < p - 2 && *config->keep_running) {
+        unsigned long chunk = checkpoint_run_chunk(&run, p - 2 - i);
+        if (use_fft) {
+            ibdwt_session_iterate(&fft, s, chunk, 1, 2);
+        } else {
+            for (unsigned long j = 0; j < chunk; j++) {
+                special_mod_sqr(&mod, s, s);
+                special_mod_sub_ui(&mod, s, 2);
+            }
+        }
+        i += chunk;
+
+        if (checkpoint_run_due(&run) && i < p - 2) {
+            if (use_fft)
+                ibdwt_session_sync(&fft);
+            checkpointed = checkpoint_save(p, CHECKPOINT_LUCAS_LEHMER, i, s, mod.n) == 0 || checkpointed;
+        }
+    }
+    if (use_fft) {
+        ibdwt_session_sync(&fft);
+        ibdwt_session_clear(&fft);
+    }
+
+    int is_prime = -1;
+    if (i == p - 2) {
+        is_prime = special_mod_is_zero(&mod, s);
+        *res64 = s[0];
+        if (checkpointed)
+            checkpoint_remove(p);
+    } else if (i > 0) {
+        // Interrupted: keep what was done for the next run
+        checkpoint_save(p, CHECKPOINT_LUCAS_LEHMER, i, s, mod.n);
+    }
+    free(s);
+    special_mod_clear(&mod);
+    return is_prime;
+}
+
+// x = x^(2^count) mod 2^p - 1, on fft when there is one (above the crossover). x's limbs are
+// then only current after ibdwt_session_sync.
+static inline void mersenne_square_repeatedly(special_mod_t* mod, ibdwt_session_t* fft, mp_limb_t* x, unsigned long count) {
+    if (fft != NULL) {
+        ibdwt_session_iterate(fft, x, count, 1, 0);
+    } else {
+        for (unsigned long i = 0; i < count; i++)
+            special_mod_sqr(mod, x, x);
+    }
+}
+
+// Iterations per Gerbicz block: about sqrt(p), so the block products cost little
+static inline unsigned long mersenne_prp_block_size(unsigned long p) {
+    unsigned long block = exponent_isqrt(p);
+    if (block < 2)
+        return 2;
+    return block > PRP_MAX_BLOCK ? PRP_MAX_BLOCK : block;
+}
+
+// Base-3 Fermat PRP test: 2^p - 1 is a probable prime iff 3^(2^p) = 9. Next to x = 3^(2^i),
+// d holds the product of x at every block boundary (starting with x_0 = 3), and any error in
+// x or d since the last check breaks d = 3 * d_prev^(2^block), where d_prev is d one block
+// earlier. A failed check rolls back to the last verified x and d. The last partial block is
+// computed twice instead. With a proof budget, the residues a Pietrzak proof needs are saved
+// on the way and proofs/<p>.proof is written at the end. Returns -1 when stopped by Ctrl-C.
+// res64 gets the low 64 bits of 3^(2^p).
+static inline int mersenne_fermat_prp(const mersenne_test_config_t* config, unsigned long p, ibdwt_team_t* team,
+                                      uint64_t* res64) {
+    *res64 = 0;
+    if (p < 3)
+        return p == 2;
+
+    special_mod_t mod;
+    special_mod_init(&mod, p, 1);
+    mp_size_t n = mod.n;
+    mp_limb_t* state = (mp_limb_t*)calloc(7 * n, sizeof(mp_limb_t));
+    mp_limb_t* x = state;                  // x and d are saved together in checkpoints
+    mp_limb_t* d = state + n;
+    mp_limb_t* verified = state + 2 * n;   // x and d as of the last passed check
+    mp_limb_t* d_prev = state + 4 * n;
+    mp_limb_t* check = state + 5 * n;
+    mp_limb_t* three = state + 6 * n;
+    special_mod_set_ui(&mod, three, 3);
+
+    unsigned long block = mersenne_prp_block_size(p);
+    unsigned long checked_end = p / block * block;
+    unsigned long i = 0;
+    int checkpointed = checkpoint_load(p, CHECKPOINT_PRP, &i, state, 2 * n);
+    if (!checkpointed || i > checked_end || i % block != 0) {
+        memcpy(x, three, n * sizeof(mp_limb_t));
+        memcpy(d, three, n * sizeof(mp_limb_t));
+        i = 0;
+    }
+    memcpy(verified, state, 2 * n * sizeof(mp_limb_t));
+    unsigned long verified_i = i;
+
+    // Proof residues all sit before the tail, which is never saved
+    prp_proof_t proof;
+    unsigned int proof_power = config->proof_budget > 0 ? prp_proof_power(p, 2 * block, config->proof_budget) : 0;
+    if (proof_power > 0)
+        prp_proof_init(&proof, p, proof_power);
+
+    // Above the crossover one transform serves x, check and the tail for the whole test
+    ibdwt_session_t session;
+    ibdwt_session_t* fft = NULL;
+    if (p >= config->fft_crossover) {
+        ibdwt_session_init(&session, &mod, team);
+        fft = &session;
+    }
+
+    checkpoint_run_t run;
+    checkpoint_run_init(&run, config->checkpoint_interval);
+    int save_pending = 0;
+    while (i < checked_end && *config->keep_running) {
+        unsigned long limit = block - i % block;
+        if (proof_power > 0 && prp_proof_next_position(&proof, i) - i < limit)
+            limit = prp_proof_next_position(&proof, i) - i;
+        unsigned long chunk = checkpoint_run_chunk(&run, limit);
+        mersenne_square_repeatedly(&mod, fft, x, chunk);
+        i += chunk;
+        if (proof_power > 0 && prp_proof_next_position(&proof, i - chunk) == i) {
+            if (fft != NULL)
+                ibdwt_session_sync(fft);
+            prp_proof_save_residue(&proof, i, x, n);
+        }
+        save_pending |= checkpoint_run_due(&run);
+        if (i % block != 0)
+            continue;
+
+        if (fft != NULL)
+            ibdwt_session_sync(fft);
+
+        memcpy(d_prev, d, n * sizeof(mp_limb_t));
+        special_mod_mul(&mod, d, d, x);
+        if (i % (block * PRP_CHECK_BLOCKS) != 0 && i != checked_end)
+            continue;
+
+        memcpy(check, d_prev, n * sizeof(mp_limb_t));
+        mersenne_square_repeatedly(&mod, fft, check, block);
+        if (fft != NULL)
+            ibdwt_session_sync(fft);
+        special_mod_mul(&mod, check, check, three);
+        if (mpn_cmp(check, d, n) != 0) {
+            fprintf(stderr, "\nGerbicz check failed for 2^%lu - 1 at iteration %lu, rolling back to %lu\n", p, i, verified_i);
+            memcpy(state, verified, 2 * n * sizeof(mp_limb_t));
+            i = verified_i;
+            continue;
+        }
+
+        memcpy(verified, state, 2 * n * sizeof(mp_limb_t));
+        verified_i = i;
+        if (save_pending && i < checked_end) {
+            checkpointed = checkpoint_save(p, CHECKPOINT_PRP, i, state, 2 * n) == 0 || checkpointed;
+            save_pending = 0;
+        }
+    }
+
+    int is_prime = -1;
+    if (i == checked_end) {
+        // Fewer than block iterations left: run them twice and compare
+        unsigned long tail = p - checked_end;
+        do {
+            memcpy(check, x, n * sizeof(mp_limb_t));
+            mersenne_square_repeatedly(&mod, fft, check, tail);
+            memcpy(d_prev, x, n * sizeof(mp_limb_t));
+            mersenne_square_repeatedly(&mod, fft, d_prev, tail);
+            if (fft != NULL)
+                ibdwt_session_sync(fft);
+        } while (mpn_cmp(check, d_prev, n) != 0);
+
+        *res64 = check[0];
+        special_mod_set_ui(&mod, d_prev, 9);
+        is_prime = mpn_cmp(check, d_prev, n) == 0;
+        if (proof_power > 0)
+            prp_proof_write(&proof, &mod, check);
+        if (checkpointed)
+            checkpoint_remove(p);
+    } else if (verified_i > 0) {
+        // Interrupted: keep the last verified state for the next run
+        checkpoint_save(p, CHECKPOINT_PRP, verified_i, verified, 2 * n);
+    }
+
+    if (fft != NULL)
+        ibdwt_session_clear(fft);
+    if (proof_power > 0)
+        prp_proof_clear(&proof);
+    free(state);
+    special_mod_clear(&mod);
+    return is_prime;
+}
+
+// The configured test on 2^p - 1. res64 is the low 64 bits of the final residue, 0 for
+// Miller-Rabin which has none.
+static inline int mersenne_test(const mersenne_test_config_t* config, primality_ctx_t* ctx, ibdwt_team_t* team,
+                                unsigned long p, uint64_t* res64) {
+    *res64 = 0;
+    if (config->engine == MERSENNE_ENGINE_PRP)
+        return mersenne_fermat_prp(config, p, team, res64);
+    if (config->engine == MERSENNE_ENGINE_MILLER_RABIN)
+        return primality_mersenne_miller_rabin(ctx, p, MERSENNE_MILLER_RABIN_ITERATIONS, config->fft_crossover,
+                                               config->keep_running);
+    return mersenne_lucas_lehmer(config, p, team, res64);
+}
+
+// Estimated peak bytes of a full test of 2^p - 1 on the configured engine
+static inline size_t mersenne_test_memory(const mersenne_test_config_t* config, unsigned long p) {
+    size_t bytes = TEST_RESIDUES * (p / 8 + 64);
+    if (p >= config->fft_crossover)
+        bytes += ibdwt_memory(p);
+    if (config->engine == MERSENNE_ENGINE_PRP)
+        bytes += config->proof_budget;
+    return bytes;
+}
+
+// Full test under the memory budget. gate is shared by the workers workers that can form a
+// team, and helper_cpus (NULL to leave them unpinned) has a CPU for each of the other
+// workers - 1. Past team_exponent, or when the budget can't hold one such test per worker,
+// the test waits for the other workers to drain their small tests and is squared on all of
+// them instead, which also keeps only one residue of that size in memory. Only tests whose
+// transform a team actually splits go that way; the rest never hold up the other workers.
+static inline int mersenne_run_test(const mersenne_test_config_t* config, primality_ctx_t* ctx, work_gate_t* gate,
+                                    int workers, const int* helper_cpus, unsigned long p, uint64_t* res64) {
+    admission_t* admission = config->admission;
+    size_t bytes = mersenne_test_memory(config, p);
+    int shareable = config->team_exponent != 0 && workers > 1 && config->engine != MERSENNE_ENGINE_MILLER_RABIN &&
+                    p >= config->fft_crossover && ibdwt_choose_length(p) >= IBDWT_TEAM_MIN_LENGTH;
+    int result;
+    if (shareable && (p >= config->team_exponent || !admission_fits(admission, bytes, workers))) {
+        ibdwt_team_t team;
+        work_gate_enter(gate);
+        admission_acquire(admission, bytes);
+        ibdwt_team_init(&team, workers, helper_cpus);
+        result = mersenne_test(config, ctx, &team, p, res64);
+        ibdwt_team_clear(&team);
+        admission_release(admission, bytes);
+        work_gate_leave(gate);
+    } else {
+        admission_acquire(admission, bytes);
+        result = mersenne_test(config, ctx, NULL, p, res64);
+        admission_release(admission, bytes);
+    }
+    return result;
+}
+
+// Checkpoint kind the configured engine writes, 0 for Miller-Rabin which writes none
+static inline int mersenne_checkpoint_kind(const mersenne_test_config_t* config) {
+    if (config->engine == MERSENNE_ENGINE_LUCAS_LEHMER)
+        return CHECKPOINT_LUCAS_LEHMER;
+    if (config->engine == MERSENNE_ENGINE_PRP)
+        return CHECKPOINT_PRP;
+    return 0;
+}
+
+// LEDGER_ENGINE_* recorded for results of the configured engine
+static inline int mersenne_ledger_engine(const mersenne_test_config_t* config) {
+    if (config->engine == MERSENNE_ENGINE_PRP)
+        return LEDGER_ENGINE_PRP;
+    if (config->engine == MERSENNE_ENGINE_MILLER_RABIN)
+        return LEDGER_ENGINE_MILLER_RABIN;
+    return LEDGER_ENGINE_LUCAS_LEHMER;
+}
+
+// Next exponent for worker thread_id: checkpointed exponents first, then the shared queue,
+// skipping what was resumed and what the ledger already has a final answer for. A checkpoint
+// for an exponent the ledger has settled is stale and gets removed. *resumed is set when p
+// comes from a checkpoint. Returns 0 when there is nothing left.
+static inline unsigned long mersenne_next_exponent(checkpoint_list_t* resume_list, work_queue_t* queue, ledger_t* ledger,
+                                                   progress_t* progress, int thread_id, int* resumed) {
+    unsigned long p;
+    *resumed = 1;
+    while ((p = checkpoint_list_next(resume_list)) != 0) {
+        if (!ledger_done(ledger, p))
+            return p;
+        checkpoint_remove(p);
+        progress_add(progress, thread_id, PROGRESS_LEDGER, 1);
+    }
+    *resumed = 0;
+    for (;;) {
+        p = work_queue_next(queue, thread_id);
+        if (p == 0)
+            return 0;
+        if (checkpoint_list_contains(resume_list, p))
+            continue;
+        if (!ledger_done(ledger, p))
+            return p;
+        progress_add(progress, thread_id, PROGRESS_LEDGER, 1);
+    }
+}
+
+#endif
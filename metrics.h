@@ -0,0 +1,222 @@
+// Metrics in the Prometheus text format, served on a local Unix socket or a localhost port.
+//
+// A server thread accepts one connection at a time, reads the HTTP request, and answers it
+// with whatever the program's write callback prints. Anything speaking HTTP can scrape it:
+// curl --unix-socket <path> http://localhost/metrics, or a scraper pointed at 127.0.0.1.
+// The per-worker counters come from progress.h, so a scrape only reads relaxed counters and
+// never blocks a worker. Only monotonic counters are exported, never rates: a scrape changes
+// nothing, so any number of scrapers can poll, and rate() in Prometheus does the rest.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "progress.h"
+
+#define METRICS_UNIX_PREFIX "unix:"
+#define METRICS_POLL_MS 250         // how often the server thread looks for a stop request
+#define METRICS_REQUEST_MAX 4096    // longest request header read before answering
+
+typedef struct metrics {
+    int fd;                         // listening socket
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];    // Unix socket to remove, or empty
+    progress_t* progress;
+    void (*write)(struct metrics*, FILE*);
+    pthread_t thread;
+    int stopping;
+} metrics_t;
+
+// Listen on address: "unix:<path>" for a Unix socket, otherwise a port on 127.0.0.1.
+// write prints the metrics for one scrape.
+static inline void metrics_open(metrics_t* metrics, const char* address, progress_t* progress, void (*write)(metrics_t*, FILE*)) {
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->progress = progress;
+    metrics->write = write;
+
+    if (strncmp(address, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0) {
+        const char* path = address + strlen(METRICS_UNIX_PREFIX);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) == 0 || strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Bad metrics socket path '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, path);
+        strcpy(metrics->path, path);
+        metrics->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path);
+        if (metrics->fd < 0 || bind(metrics->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            perror("Failed to bind metrics socket");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        char* end;
+        long port = strtol(address, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Bad metrics address '%s' (expected a port or unix:<path>)\n", address);
+            exit(EXIT_FAILURE);
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        metrics->fd = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        if (metrics->fd >= 0)
+            setsockopt(metrics->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (metrics->fd < 0 || bind(metrics->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            perror("Failed to bind metrics port");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen(metrics->fd, 8) != 0) {
+        perror("Failed to listen for metrics");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The # HELP and # TYPE lines that start a metric family
+static inline void metrics_family(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static inline void metrics_gauge(FILE* out, const char* name, const char* help, double value) {
+    metrics_family(out, name, "gauge", help);
+    if (isnan(value))
+        fprintf(out, "%s NaN\n", name);
+    else
+        fprintf(out, "%s %.17g\n", name, value);
+}
+
+static inline void metrics_counter(FILE* out, const char* name, const char* help, unsigned long long value) {
+    metrics_family(out, name, "counter", help);
+    fprintf(out, "%s %llu\n", name, value);
+}
+
+// Resident set size of the process in bytes, 0 if /proc can't say
+static inline double metrics_resident_bytes(void) {
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+        return 0;
+    unsigned long size, resident;
+    int ok = fscanf(file, "%lu %lu", &size, &resident) == 2;
+    fclose(file);
+    return ok ? (double)resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Candidates checked per worker and in total, plus uptime and resident memory. Every name
+// starts with prefix.
+static inline void metrics_write_progress(metrics_t* metrics, FILE* out, const char* prefix) {
+    progress_t* progress = metrics->progress;
+    char name[128];
+
+    snprintf(name, sizeof(name), "%s_thread_candidates_checked_total", prefix);
+    metrics_family(out, name, "counter", "Exponents settled by each worker");
+    unsigned long long total = 0;
+    for (int i = 0; i < progress->count; i++) {
+        unsigned long long checked = progress_count(progress, i, PROGRESS_CHECKED);
+        fprintf(out, "%s{thread=\"%d\"} %llu\n", name, i, checked);
+        total += checked;
+    }
+
+    snprintf(name, sizeof(name), "%s_candidates_checked_total", prefix);
+    metrics_counter(out, name, "Exponents settled by all workers", total);
+    snprintf(name, sizeof(name), "%s_uptime_seconds", prefix);
+    metrics_gauge(out, name, "Seconds since the search started", progress_elapsed(progress));
+    snprintf(name, sizeof(name), "%s_resident_bytes", prefix);
+    metrics_gauge(out, name, "Resident memory of the process", metrics_resident_bytes());
+}
+
+static inline int metrics_send(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Read the request header (or give up after a second) and answer with a scrape
+static inline void metrics_serve(metrics_t* metrics, int fd) {
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[METRICS_REQUEST_MAX + 1];
+    size_t length = 0;
+    while (length < METRICS_REQUEST_MAX) {
+        ssize_t got = recv(fd, request + length, METRICS_REQUEST_MAX - length, 0);
+        if (got <= 0)
+            break;
+        length += (size_t)got;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+
+    char* body = NULL;
+    size_t body_size = 0;
+    FILE* out = open_memstream(&body, &body_size);
+    if (out == NULL)
+        return;
+    metrics->write(metrics, out);
+    fclose(out);
+
+    char header[256];
+    int header_size = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_size);
+    if (metrics_send(fd, header, (size_t)header_size) == 0)
+        metrics_send(fd, body, body_size);
+    free(body);
+}
+
+static inline void* metrics_thread(void* arg) {
+    metrics_t* metrics = (metrics_t*)arg;
+    struct pollfd waiting = {metrics->fd, POLLIN, 0};
+    while (!__atomic_load_n(&metrics->stopping, __ATOMIC_RELAXED)) {
+        if (poll(&waiting, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        int fd = accept(metrics->fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        metrics_serve(metrics, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static inline void metrics_start(metrics_t* metrics) {
+    if (pthread_create(&metrics->thread, NULL, metrics_thread, metrics) != 0) {
+        perror("Failed to create metrics thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Stop serving, close the socket and remove it from the filesystem
+static inline void metrics_close(metrics_t* metrics) {
+    __atomic_store_n(&metrics->stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(metrics->thread, NULL);
+    close(metrics->fd);
+    if (metrics->path[0] != '\0')
+        unlink(metrics->path);
+}
+
+#endif
@@ -0,0 +1,557 @@
+// Pollard P-1 factoring stage for 2^p - 1.
+//
+// A factor q of 2^p - 1 has q = 1 (mod 2p). When the rest of q - 1 is B1-smooth apart from
+// at most one prime up to B2, P-1 finds q much more cheaply than a full primality test.
+//
+//   stage 1: x = 3^E mod M_p with E = 2p * (all prime powers <= B1), then gcd(x - 1, M_p)
+//   stage 2: every prime B1 < s <= B2 is written as s = kD +- j and covered by a factor
+//            V(kD) - V(j) of the accumulator, V(n) = x^n + x^-n. That factor vanishes mod q
+//            for both kD - j and kD + j, so a pair of primes costs a single multiplication.
+//
+// Residues live in raw limbs: special_mod_t does the products below the FFT crossover and an
+// IBDWT session above it, where stage 1 is nothing but squarings times 1 or 3 and stage 2
+// products take one extra forward transform.
+//
+// B1 comes from the size of p. B2 and D (and with it how many V(j) are kept in memory) come
+// from a cost estimate of both stages in squarings, held to a share of a full test, and from
+// the memory the caller can spare. Every finished run is appended to a results file so the same
+// exponent is never run again with the same or smaller bounds, and bounds the ledger already
+// has for p count as well.
+
+#ifndef PMINUS1_H
+#define PMINUS1_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <math.h>
+#include <gmp.h>
+
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+#include "ledger.h"
+
+#define PM1_MIN_EXPONENT 10000     // below this a full test is cheaper than P-1
+#define PM1_B1_DIVISOR 60          // B1 = p / 60 keeps stage 1 near 2.5% of a full test
+#define PM1_MIN_B1 500
+#define PM1_STAGE1_BATCH_BITS 4096 // stage 1 exponent bits between looks at keep_running
+#define PM1_COST_SHARE 0.06        // both stages together may cost this share of a full test
+#define PM1_MUL_COST 1.5           // a product of two residues, in squarings
+#define PM1_WORK_RESIDUES 16       // residues besides the V(j) table: x, the V(kD) walk, accumulator, special_mod's buffers
+
+typedef struct {
+    unsigned long p;
+    unsigned long b1;
+    unsigned long b2;
+    int factored;
+} pm1_record_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    FILE* file;
+    pm1_record_t* records;
+    size_t count;
+    size_t capacity;
+} pm1_log_t;
+
+// Candidate D values, smallest first, with the number of V(j) (j < D/2, gcd(j, D) = 1) each keeps
+static const unsigned long pm1_d_values[] = { 30, 210, 2310, 30030 };
+static const unsigned long pm1_d_residues[] = { 4, 24, 240, 2880 };
+static const unsigned long pm1_b2_multipliers[] = { 50, 30, 20, 10, 5 };   // B2 / B1 to try, largest first
+
+static inline void pm1_log_append(pm1_log_t* log, unsigned long p, unsigned long b1, unsigned long b2, int factored) {
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 256;
+        log->records = (pm1_record_t*)realloc(log->records, log->capacity * sizeof(pm1_record_t));
+    }
+    pm1_record_t* record = &log->records[log->count++];
+    record->p = p;
+    record->b1 = b1;
+    record->b2 = b2;
+    record->factored = factored;
+}
+
+// Load earlier results from path and keep it open for appending new ones.
+// Each line is "p B1 B2 factor", with factor 0 when none was found.
+static inline void pm1_log_open(pm1_log_t* log, const char* path) {
+    pthread_mutex_init(&log->lock, NULL);
+    log->records = NULL;
+    log->count = 0;
+    log->capacity = 0;
+
+    FILE* in = fopen(path, "r");
+    if (in) {
+        char line[4096];
+        while (fgets(line, sizeof(line), in)) {
+            unsigned long p, b1, b2;
+            char factor[4000];
+            if (sscanf(line, "%lu %lu %lu %3999s", &p, &b1, &b2, factor) == 4)
+                pm1_log_append(log, p, b1, b2, strcmp(factor, "0") != 0);
+        }
+        fclose(in);
+    }
+
+    log->file = fopen(path, "a");
+    if (!log->file)
+        perror("Failed to open P-1 results file");
+}
+
+static inline void pm1_log_close(pm1_log_t* log) {
+    if (log->file)
+        fclose(log->file);
+    free(log->records);
+    pthread_mutex_destroy(&log->lock);
+}
+
+// Best earlier result for p; returns 0 when p was never run
+static inline int pm1_log_find(pm1_log_t* log, unsigned long p, pm1_record_t* out) {
+    int found = 0;
+    pthread_mutex_lock(&log->lock);
+    for (size_t i = 0; i < log->count; i++) {
+        pm1_record_t* record = &log->records[i];
+        if (record->p != p)
+            continue;
+        if (!found || record->factored || record->b2 > out->b2)
+            *out = *record;
+        found = 1;
+        if (record->factored)
+            break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return found;
+}
+
+static inline void pm1_log_add(pm1_log_t* log, unsigned long p, unsigned long b1, unsigned long b2, mpz_t factor) {
+    pthread_mutex_lock(&log->lock);
+    pm1_log_append(log, p, b1, b2, factor != NULL);
+    if (log->file) {
+        fprintf(log->file, "%lu %lu %lu ", p, b1, b2);
+        if (factor)
+            mpz_out_str(log->file, 10, factor);
+        else
+            fputc('0', log->file);
+        fputc('\n', log->file);
+        fflush(log->file);
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Bytes of a run on p apart from the V(j) table: the working residues and, from the FFT
+// crossover up, a transform that can multiply
+static inline size_t pm1_fixed_memory(unsigned long p, unsigned long fft_crossover) {
+    size_t bytes = PM1_WORK_RESIDUES * (p / 8 + 64);
+    if (p >= fft_crossover)
+        bytes += ibdwt_memory(p) + ibdwt_mul_memory(p);
+    return bytes;
+}
+
+// Index of the largest D whose V(j) table, plus the rest of the run, fits in memory
+static inline int pm1_choose_d(unsigned long p, size_t memory, unsigned long fft_crossover) {
+    size_t residue_bytes = p / 8 + 64;
+    size_t fixed = pm1_fixed_memory(p, fft_crossover);
+    for (int i = sizeof(pm1_d_values) / sizeof(pm1_d_values[0]) - 1; i > 0; i--) {
+        if (pm1_d_residues[i] * residue_bytes + fixed <= memory)
+            return i;
+    }
+    return 0;
+}
+
+// Stage 1 cost in squarings: E has about log2(e) * B1 bits, and the multiplies by 3 are free
+static inline double pm1_stage1_cost(unsigned long b1) {
+    return M_LOG2E * b1;
+}
+
+// Stage 2 cost in squarings with D = pm1_d_values[choice]. A (k, j) slot costs one product
+// when kD - j or kD + j is prime, each of which is with probability q = D / (phi(D) ln s);
+// on top come one product per giant step and D / 4 baby steps.
+static inline double pm1_stage2_cost(unsigned long b1, unsigned long b2, int choice) {
+    if (b2 <= b1)
+        return 0.0;
+    double d = (double)pm1_d_values[choice];
+    double residues = (double)pm1_d_residues[choice];
+    double steps = (b2 - b1) / d;
+    double q = d / (2.0 * residues * log(0.5 * ((double)b1 + b2)));
+    if (q > 1.0)
+        q = 1.0;
+    return PM1_MUL_COST * (steps * residues * (2.0 * q - q * q) + steps + d / 4.0);
+}
+
+// Pick B1, B2 and D for p given the bytes this run may hold. B1 comes from p, and B2 is the
+// largest multiple of it that keeps both stages within PM1_COST_SHARE of a full test with
+// the cheapest D whose table fits; returns the index of that D.
+static inline int pm1_choose_bounds(unsigned long p, size_t memory, unsigned long fft_crossover,
+                                    unsigned long* b1, unsigned long* b2, unsigned long* d) {
+    int largest = pm1_choose_d(p, memory, fft_crossover);
+
+    *b1 = p / PM1_B1_DIVISOR;
+    if (*b1 < PM1_MIN_B1)
+        *b1 = PM1_MIN_B1;
+    *b2 = *b1;
+    *d = pm1_d_values[0];
+
+    double budget = PM1_COST_SHARE * p - pm1_stage1_cost(*b1);
+    for (size_t m = 0; m < sizeof(pm1_b2_multipliers) / sizeof(pm1_b2_multipliers[0]); m++) {
+        unsigned long b2_try = *b1 * pm1_b2_multipliers[m];
+        int best = 0;
+        for (int i = 1; i <= largest; i++) {
+            if (pm1_stage2_cost(*b1, b2_try, i) < pm1_stage2_cost(*b1, b2_try, best))
+                best = i;
+        }
+        if (pm1_stage2_cost(*b1, b2_try, best) <= budget) {
+            *b2 = b2_try;
+            *d = pm1_d_values[best];
+            return best;
+        }
+    }
+    return 0;
+}
+
+// Peak bytes a P-1 run on p holds when given memory (stage 2 is the larger stage)
+static inline size_t pm1_stage_memory(unsigned long p, size_t memory, unsigned long fft_crossover) {
+    if (p < PM1_MIN_EXPONENT)
+        return 0;
+    unsigned long b1, b2, d;
+    int choice = pm1_choose_bounds(p, memory, fft_crossover, &b1, &b2, &d);
+    return pm1_d_residues[choice] * (p / 8 + 64) + pm1_fixed_memory(p, fft_crossover);
+}
+
+// Bitset over the odd numbers below limit, set when the number is prime
+static inline unsigned char* pm1_odd_prime_bits(unsigned long limit) {
+    size_t bytes = limit / 16 + 1;
+    unsigned char* bits = (unsigned char*)malloc(bytes);
+    memset(bits, 0xff, bytes);
+    bits[0] &= ~1;   // 1 is not prime
+    for (unsigned long i = 3; i * i < limit; i += 2) {
+        if (bits[i >> 4] & (1 << ((i >> 1) & 7))) {
+            for (unsigned long j = i * i; j < limit; j += 2 * i)
+                bits[j >> 4] &= ~(1 << ((j >> 1) & 7));
+        }
+    }
+    return bits;
+}
+
+static inline int pm1_is_prime(const unsigned char* bits, unsigned long n) {
+    if (n < 3)
+        return n == 2;
+    return (n & 1) && (bits[n >> 4] & (1 << ((n >> 1) & 7)));
+}
+
+static inline unsigned long pm1_gcd(unsigned long a, unsigned long b) {
+    while (b) {
+        unsigned long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Residue arithmetic mod 2^p - 1 for a run: special_mod below the FFT crossover, the IBDWT
+// from it up
+typedef struct {
+    special_mod_t mod;
+    ibdwt_session_t fft;
+    int use_fft;
+} pm1_arith_t;
+
+static inline void pm1_arith_init(pm1_arith_t* arith, unsigned long p, unsigned long fft_crossover) {
+    special_mod_init(&arith->mod, p, 1);
+    arith->use_fft = p >= fft_crossover;
+    if (arith->use_fft)
+        ibdwt_session_init(&arith->fft, &arith->mod, NULL);
+}
+
+static inline void pm1_arith_clear(pm1_arith_t* arith) {
+    if (arith->use_fft)
+        ibdwt_session_clear(&arith->fft);
+    special_mod_clear(&arith->mod);
+}
+
+// rp = ap * bp; rp may alias either input
+static inline void pm1_mul(pm1_arith_t* arith, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp) {
+    if (arith->use_fft)
+        ibdwt_session_mul(&arith->fft, rp, ap, bp);
+    else
+        special_mod_mul(&arith->mod, rp, ap, bp);
+}
+
+// x = x^2 * multiplier - subtrahend, count times
+static inline void pm1_square(pm1_arith_t* arith, mp_limb_t* x, unsigned long count, long multiplier, long subtrahend) {
+    if (arith->use_fft) {
+        ibdwt_session_iterate(&arith->fft, x, count, multiplier, subtrahend);
+        ibdwt_session_sync(&arith->fft);
+        return;
+    }
+    for (unsigned long i = 0; i < count; i++) {
+        special_mod_sqr(&arith->mod, x, x);
+        if (multiplier != 1)
+            special_mod_mul_ui(&arith->mod, x, x, (mp_limb_t)multiplier);
+        if (subtrahend != 0)
+            special_mod_sub_ui(&arith->mod, x, (mp_limb_t)subtrahend);
+    }
+}
+
+// V(n) from V(1) with the ladder V(2m) = V(m)^2 - 2, V(2m + 1) = V(m + 1) V(m) - V(1)
+static inline void pm1_lucas_v(pm1_arith_t* arith, mp_limb_t* out, const mp_limb_t* v1, unsigned long n) {
+    special_mod_t* mod = &arith->mod;
+    if (n == 0) {
+        special_mod_set_ui(mod, out, 2);
+        return;
+    }
+
+    mp_limb_t* lo = special_mod_alloc(mod);
+    mp_limb_t* hi = special_mod_alloc(mod);
+    special_mod_set_ui(mod, lo, 2);                 // V(0)
+    memcpy(hi, v1, mod->n * sizeof(mp_limb_t));     // V(1)
+
+    for (int bit = 63 - __builtin_clzl(n); bit >= 0; bit--) {
+        mp_limb_t* mixed = (n >> bit) & 1 ? lo : hi;
+        mp_limb_t* doubled = (n >> bit) & 1 ? hi : lo;
+        pm1_mul(arith, mixed, lo, hi);
+        special_mod_sub(mod, mixed, mixed, v1);
+        pm1_square(arith, doubled, 1, 1, 2);
+    }
+
+    memcpy(out, lo, mod->n * sizeof(mp_limb_t));
+    free(lo);
+    free(hi);
+}
+
+// Keep gcd(x, mersenne) only when it is a proper factor of the modulus
+static inline int pm1_check_gcd(mpz_t factor, pm1_arith_t* arith, const mp_limb_t* x, const mpz_t mersenne) {
+    mpz_t g;
+    mpz_init(g);
+    special_mod_get_mpz(&arith->mod, g, x);
+    mpz_gcd(g, g, mersenne);
+    int found = mpz_cmp_ui(g, 1) > 0 && mpz_cmp(g, mersenne) < 0;
+    if (found)
+        mpz_set(factor, g);
+    mpz_clear(g);
+    return found;
+}
+
+// E = 2p * (all prime powers <= B1), multiplied up from batches of a few thousand bits
+static inline void pm1_stage1_exponent(mpz_t e, const unsigned char* primes, unsigned long p, unsigned long b1) {
+    size_t count = 0, capacity = 64;
+    mpz_t* batches = (mpz_t*)malloc(capacity * sizeof(mpz_t));
+    mpz_init_set_ui(batches[count++], 2 * p);
+    for (unsigned long q = 2; q <= b1; q++) {
+        if (!pm1_is_prime(primes, q))
+            continue;
+        unsigned long power = q;
+        while (power <= b1 / q)
+            power *= q;
+        if (mpz_sizeinbase(batches[count - 1], 2) >= PM1_STAGE1_BATCH_BITS) {
+            if (count == capacity) {
+                capacity *= 2;
+                batches = (mpz_t*)realloc(batches, capacity * sizeof(mpz_t));
+            }
+            mpz_init_set_ui(batches[count++], 1);
+        }
+        mpz_mul_ui(batches[count - 1], batches[count - 1], power);
+    }
+
+    // Pairwise products keep the operands of every multiplication about the same size
+    while (count > 1) {
+        size_t next = 0;
+        for (size_t i = 0; i < count; i += 2) {
+            if (i + 1 < count) {
+                mpz_mul(batches[i], batches[i], batches[i + 1]);
+                mpz_clear(batches[i + 1]);
+            }
+            mpz_swap(batches[next++], batches[i]);
+        }
+        count = next;
+    }
+    mpz_swap(e, batches[0]);
+    mpz_clear(batches[0]);
+    free(batches);
+}
+
+// Run P-1 on mersenne = 2^p - 1; returns 1 and sets factor when a proper factor is found.
+// From fft_crossover up the residues are multiplied with the IBDWT. keep_running (NULL to
+// never stop) is checked every PM1_STAGE1_BATCH_BITS bits of stage 1 and between stage 2
+// giant steps; returns -1 once it is cleared.
+static inline int pm1_factor(mpz_t factor, const mpz_t mersenne, unsigned long p,
+                      unsigned long b1, unsigned long b2, unsigned long d, unsigned long fft_crossover,
+                      const volatile sig_atomic_t* keep_running) {
+    pm1_arith_t arith;
+    pm1_arith_init(&arith, p, fft_crossover);
+    special_mod_t* mod = &arith.mod;
+    mp_limb_t* x = special_mod_alloc(mod);
+    mp_limb_t* t = special_mod_alloc(mod);
+    int found = 0;
+
+    // Stage 1: x = 3^E left to right, so every step is a squaring times 1 or 3 and a run of
+    // equal bits is one call
+    unsigned char* primes = pm1_odd_prime_bits(b2 + d + 1);
+    mpz_t e;
+    mpz_init(e);
+    pm1_stage1_exponent(e, primes, p, b1);
+    special_mod_set_ui(mod, x, 1);
+    long bit = (long)mpz_sizeinbase(e, 2) - 1;
+    while (bit >= 0) {
+        if (keep_running && !*keep_running) {
+            found = -1;
+            break;
+        }
+        long stop = bit >= PM1_STAGE1_BATCH_BITS ? bit - PM1_STAGE1_BATCH_BITS : -1;
+        while (bit > stop) {
+            int value = mpz_tstbit(e, bit);
+            long run = bit;
+            while (run > stop && mpz_tstbit(e, run) == value)
+                run--;
+            pm1_square(&arith, x, (unsigned long)(bit - run), value ? 3 : 1, 0);
+            bit = run;
+        }
+    }
+    mpz_clear(e);
+
+    if (found == 0) {
+        memcpy(t, x, mod->n * sizeof(mp_limb_t));
+        special_mod_sub_ui(mod, t, 1);
+        found = pm1_check_gcd(factor, &arith, t, mersenne);
+    }
+
+    // Stage 2 on V(n) = x^n + x^-n, primes s in (B1, B2] as s = kD +- j
+    mpz_t inverse;
+    mpz_init(inverse);
+    special_mod_get_mpz(mod, inverse, x);
+    if (found == 0 && b2 > b1 && mpz_invert(inverse, inverse, mersenne)) {
+        unsigned long half = d / 2;
+        mp_limb_t* v1 = special_mod_alloc(mod);
+        mp_limb_t* v2 = special_mod_alloc(mod);
+        mp_limb_t* vd = special_mod_alloc(mod);
+        mp_limb_t* vk = special_mod_alloc(mod);
+        mp_limb_t* vk_prev = special_mod_alloc(mod);
+        mp_limb_t* acc = special_mod_alloc(mod);
+
+        special_mod_set_mpz(mod, v1, inverse);
+        special_mod_add(mod, v1, v1, x);
+        memcpy(v2, v1, mod->n * sizeof(mp_limb_t));
+        pm1_square(&arith, v2, 1, 1, 2);
+
+        // Baby steps V(j) for odd j < D/2 coprime to D, with V(j + 2) = V(j) V(2) - V(j - 2)
+        size_t residues = 0;
+        for (unsigned long j = 1; j < half; j += 2)
+            residues += pm1_gcd(j, d) == 1;
+        unsigned long* js = (unsigned long*)malloc(residues * sizeof(unsigned long));
+        mp_limb_t* vj = (mp_limb_t*)malloc(residues * mod->n * sizeof(mp_limb_t));
+        residues = 0;
+        mp_limb_t* v_prev = vk_prev;     // V(-1) = V(1); the giant step buffers are free until then
+        mp_limb_t* v_cur = vk;           // V(1)
+        mp_limb_t* v_next = acc;
+        memcpy(v_prev, v1, mod->n * sizeof(mp_limb_t));
+        memcpy(v_cur, v1, mod->n * sizeof(mp_limb_t));
+        for (unsigned long j = 1; j < half; j += 2) {
+            if (pm1_gcd(j, d) == 1) {
+                js[residues] = j;
+                memcpy(vj + residues * mod->n, v_cur, mod->n * sizeof(mp_limb_t));
+                residues++;
+            }
+            pm1_mul(&arith, v_next, v_cur, v2);
+            special_mod_sub(mod, v_next, v_next, v_prev);
+            mp_limb_t* swap = v_prev;
+            v_prev = v_cur;
+            v_cur = v_next;
+            v_next = swap;
+        }
+
+        // Giant steps V(kD), walking V((k + 1)D) = V(kD) V(D) - V((k - 1)D)
+        unsigned long k = b1 / d;
+        pm1_lucas_v(&arith, vd, v1, d);
+        pm1_lucas_v(&arith, vk, v1, k * d);
+        pm1_lucas_v(&arith, vk_prev, v1, k ? (k - 1) * d : d);
+        special_mod_set_ui(mod, acc, 1);
+
+        for (; k * d <= b2 + half; k++) {
+            if (keep_running && !*keep_running) {
+                found = -1;
+                break;
+            }
+            for (size_t i = 0; i < residues; i++) {
+                unsigned long below = k * d - js[i], above = k * d + js[i];
+                int use_below = k * d > js[i] && below > b1 && below <= b2 && pm1_is_prime(primes, below);
+                int use_above = above > b1 && above <= b2 && pm1_is_prime(primes, above);
+                if (use_below || use_above) {
+                    special_mod_sub(mod, t, vk, vj + i * mod->n);
+                    pm1_mul(&arith, acc, acc, t);
+                }
+            }
+
+            // vk_prev becomes V((k + 1)D)
+            pm1_mul(&arith, t, vk, vd);
+            special_mod_sub(mod, vk_prev, t, vk_prev);
+            mp_limb_t* swap = vk_prev;
+            vk_prev = vk;
+            vk = swap;
+        }
+
+        if (found == 0)
+            found = pm1_check_gcd(factor, &arith, acc, mersenne);
+
+        free(vj);
+        free(js);
+        free(v1);
+        free(v2);
+        free(vd);
+        free(vk);
+        free(vk_prev);
+        free(acc);
+    }
+    mpz_clear(inverse);
+
+    free(primes);
+    free(x);
+    free(t);
+    pm1_arith_clear(&arith);
+    return found;
+}
+
+// P-1 stage for the search loop: skips work already in the log or the ledger (NULL for none),
+// which also holds P-1 results imported from elsewhere, otherwise runs and records it.
+// Returns 1 when 2^p - 1 is known to have a factor, -1 when keep_running was cleared mid-run
+// (nothing is recorded then). *b1_run and *b2_run get the bounds when P-1 actually ran to the
+// end, 0 otherwise.
+static inline int pm1_stage(pm1_log_t* log, ledger_t* ledger, const mpz_t mersenne, unsigned long p, size_t memory,
+                     unsigned long fft_crossover, unsigned long* b1_run, unsigned long* b2_run,
+                     const volatile sig_atomic_t* keep_running) {
+    *b1_run = 0;
+    *b2_run = 0;
+    if (p < PM1_MIN_EXPONENT)
+        return 0;
+
+    unsigned long b1, b2, d;
+    pm1_choose_bounds(p, memory, fft_crossover, &b1, &b2, &d);
+
+    pm1_record_t previous = { 0, 0, 0, 0 };
+    if (pm1_log_find(log, p, &previous)) {
+        if (previous.factored)
+            return 1;
+        if (previous.b1 >= b1 && previous.b2 >= b2)
+            return 0;
+    }
+    ledger_record_t record;
+    if (ledger != NULL && ledger_find(ledger, p, &record)) {
+        if (record.status >= LEDGER_FACTORED)
+            return record.status == LEDGER_FACTORED;
+        if (record.status == LEDGER_PM1_DONE && record.b1 >= b1 && record.b2 >= b2)
+            return 0;
+    }
+
+    mpz_t factor;
+    mpz_init(factor);
+    int found = pm1_factor(factor, mersenne, p, b1, b2, d, fft_crossover, keep_running);
+    if (found < 0) {
+        mpz_clear(factor);
+        return -1;
+    }
+    pm1_log_add(log, p, b1, b2, found ? factor : NULL);
+    *b1_run = b1;
+    *b2_run = b2;
+    mpz_clear(factor);
+    return found;
+}
+
+#endif
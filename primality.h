@@ -0,0 +1,191 @@
+// Miller-Rabin tests shared by prime.c and the Mersenne searchers.
+//
+// Each thread owns a primality_ctx_t. It holds the mpz temporaries, the residue buffers and a
+// random state, all set up once, so a test allocates nothing and seeds nothing. Every context
+// is seeded separately from /dev/urandom (falling back to the clock and the context id), so
+// threads that start in the same second still pick different bases.
+//
+// For Mersenne numbers the context also keeps 2^p - 1 and its special_mod_t for the current
+// p, rebuilt in place when p changes, and above the FFT crossover one IBDWT session that every
+// round on that p reuses.
+
+#ifndef PRIMALITY_H
+#define PRIMALITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <gmp.h>
+
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+
+#define PRIMALITY_MR_CHUNK 1024  // Mersenne Miller-Rabin steps between looks at keep_running
+
+typedef struct {
+    gmp_randstate_t rnd;
+    mpz_t base, y, odd_part, n_minus_one;
+    mpz_t mersenne;             // 2^mersenne_p - 1
+    unsigned long mersenne_p;   // 0 until primality_set_mersenne is called
+    special_mod_t mod;          // arithmetic mod 2^mersenne_p - 1
+    mp_limb_t* a;               // residue scratch, scratch_limbs each
+    mp_limb_t* r;
+    mp_size_t scratch_limbs;
+    ibdwt_session_t fft;        // on mod, once fft_ready
+    int fft_ready;
+} primality_ctx_t;
+
+static inline unsigned long primality_seed(unsigned long id) {
+    unsigned long seed = 0;
+    FILE* urandom = fopen("/dev/urandom", "rb");
+    if (urandom != NULL) {
+        if (fread(&seed, sizeof(seed), 1, urandom) != 1)
+            seed = 0;
+        fclose(urandom);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return seed ^ (unsigned long)ts.tv_nsec ^ ((unsigned long)ts.tv_sec << 32) ^ (id + 1) * 0x9e3779b97f4a7c15UL;
+}
+
+// id only has to differ between threads; it goes into the seed
+static inline void primality_ctx_init(primality_ctx_t* ctx, unsigned long id) {
+    gmp_randinit_default(ctx->rnd);
+    gmp_randseed_ui(ctx->rnd, primality_seed(id));
+    mpz_inits(ctx->base, ctx->y, ctx->odd_part, ctx->n_minus_one, ctx->mersenne, NULL);
+    ctx->mersenne_p = 0;
+    ctx->a = NULL;
+    ctx->r = NULL;
+    ctx->scratch_limbs = 0;
+    ctx->fft_ready = 0;
+}
+
+static inline void primality_ctx_clear(primality_ctx_t* ctx) {
+    if (ctx->fft_ready)
+        ibdwt_session_clear(&ctx->fft);
+    if (ctx->mersenne_p != 0)
+        special_mod_clear(&ctx->mod);
+    free(ctx->a);
+    free(ctx->r);
+    mpz_clears(ctx->base, ctx->y, ctx->odd_part, ctx->n_minus_one, ctx->mersenne, NULL);
+    gmp_randclear(ctx->rnd);
+}
+
+// Make ctx->mersenne = 2^p - 1 by writing its limbs directly into the existing allocation
+static inline void primality_set_mersenne(primality_ctx_t* ctx, unsigned long p) {
+    if (ctx->mersenne_p == p)
+        return;
+    if (ctx->fft_ready)
+        ibdwt_session_clear(&ctx->fft);
+    ctx->fft_ready = 0;
+    if (ctx->mersenne_p != 0)
+        special_mod_clear(&ctx->mod);
+    special_mod_init(&ctx->mod, p, 1);
+    ctx->mersenne_p = p;
+
+    mp_size_t n = ctx->mod.n;
+    mp_limb_t* limbs = mpz_limbs_write(ctx->mersenne, n);
+    memcpy(limbs, ctx->mod.modulus, n * sizeof(mp_limb_t));
+    mpz_limbs_finish(ctx->mersenne, n);
+
+    if (n > ctx->scratch_limbs) {
+        ctx->a = (mp_limb_t*)realloc(ctx->a, n * sizeof(mp_limb_t));
+        ctx->r = (mp_limb_t*)realloc(ctx->r, n * sizeof(mp_limb_t));
+        ctx->scratch_limbs = n;
+    }
+}
+
+// Miller-Rabin with random bases on any n
+static inline int primality_miller_rabin(primality_ctx_t* ctx, const mpz_t n, int iterations) {
+    if (mpz_cmp_ui(n, 2) < 0)
+        return 0;
+    if (mpz_cmp_ui(n, 2) == 0)
+        return 1;
+    if (mpz_even_p(n))
+        return 0;
+    if (mpz_cmp_ui(n, 3) == 0)
+        return 1;
+
+    mpz_sub_ui(ctx->n_minus_one, n, 1);
+    unsigned long s = mpz_scan1(ctx->n_minus_one, 0);
+    mpz_fdiv_q_2exp(ctx->odd_part, ctx->n_minus_one, s);
+
+    for (int i = 0; i < iterations; i++) {
+        // Base in [2, n - 2]
+        mpz_sub_ui(ctx->base, ctx->n_minus_one, 2);
+        mpz_urandomm(ctx->base, ctx->rnd, ctx->base);
+        mpz_add_ui(ctx->base, ctx->base, 2);
+        mpz_powm(ctx->y, ctx->base, ctx->odd_part, n);
+
+        if (mpz_cmp_ui(ctx->y, 1) == 0 || mpz_cmp(ctx->y, ctx->n_minus_one) == 0)
+            continue;
+        unsigned long j;
+        for (j = 1; j < s; j++) {
+            mpz_powm_ui(ctx->y, ctx->y, 2, n);
+            if (mpz_cmp(ctx->y, ctx->n_minus_one) == 0 || mpz_cmp_ui(ctx->y, 1) == 0)
+                break;
+        }
+        if (j == s || mpz_cmp_ui(ctx->y, 1) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Miller-Rabin on n = 2^p - 1. Here n - 1 = 2 * (2^(p-1) - 1), so each round is a^(2^(p-1) - 1),
+// i.e. p - 2 square-and-multiply steps mod n, and it passes when the result is +-1.
+// From fft_crossover up the steps run on the IBDWT with small bases. keep_running (NULL to
+// never stop) is checked between rounds and every PRIMALITY_MR_CHUNK steps; returns -1 once
+// it is cleared.
+static inline int primality_mersenne_miller_rabin(primality_ctx_t* ctx, unsigned long p, int iterations, unsigned long fft_crossover,
+                                                  const volatile sig_atomic_t* keep_running) {
+    if (p < 3)
+        return p == 2;
+
+    primality_set_mersenne(ctx, p);
+    special_mod_t* mod = &ctx->mod;
+    mp_limb_t* a = ctx->a;
+    mp_limb_t* y = ctx->r;
+    mpz_sub_ui(ctx->n_minus_one, ctx->mersenne, 1);
+
+    for (int i = 0; i < iterations; i++) {
+        if (keep_running && !*keep_running)
+            return -1;
+        unsigned long j = 0;
+        if (p >= fft_crossover && mpz_cmp_ui(ctx->mersenne, IBDWT_MAX_MULTIPLIER) > 0) {
+            // The IBDWT multiplies by small bases for free in its carry pass
+            long small_base = 3 + (long)gmp_urandomm_ui(ctx->rnd, IBDWT_MAX_MULTIPLIER - 3);
+            special_mod_set_ui(mod, y, (mp_limb_t)small_base);
+            if (!ctx->fft_ready)
+                ibdwt_session_init(&ctx->fft, mod, NULL);
+            ctx->fft_ready = 1;
+            for (; j < p - 2 && (!keep_running || *keep_running); j += PRIMALITY_MR_CHUNK) {
+                unsigned long chunk = p - 2 - j < PRIMALITY_MR_CHUNK ? p - 2 - j : PRIMALITY_MR_CHUNK;
+                ibdwt_session_iterate(&ctx->fft, y, chunk, small_base, 0);
+            }
+            ibdwt_session_sync(&ctx->fft);
+        } else {
+            mpz_urandomm(ctx->base, ctx->rnd, ctx->n_minus_one);
+            mpz_add_ui(ctx->base, ctx->base, 1);
+            special_mod_set_mpz(mod, a, ctx->base);
+            memcpy(y, a, mod->n * sizeof(mp_limb_t));
+
+            for (; j < p - 2; j++) {
+                if (j % PRIMALITY_MR_CHUNK == 0 && keep_running && !*keep_running)
+                    break;
+                special_mod_sqr(mod, y, y);
+                special_mod_mul(mod, y, y, a);
+            }
+        }
+        if (j < p - 2)
+            return -1;
+
+        if (!special_mod_equal_ui(mod, y, 1) && !special_mod_is_minus_one(mod, y))
+            return 0;
+    }
+    return 1;
+}
+
+#endif
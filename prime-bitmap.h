@@ -0,0 +1,335 @@
+// Prime candidates stored on a mod 30 wheel: one byte per 30 integers, one bit per residue
+// coprime to 30.
+//
+// Only n = 30i + r with r in {1, 7, 11, 13, 17, 19, 23, 29} can be prime past 5, so byte i
+// bit b stands for 30i + prime_bitmap_residues[b] and everything else is left out. That is
+// 8 bits per 30 integers instead of a byte (or an int) each, 30x less than a bool per integer,
+// so ranges that didn't fit in RAM do and windows that didn't fit in cache do. A set bit is a
+// candidate; sieving clears bits. 2, 3 and 5 are not in the bitmap and callers count them.
+//
+// Crossing off p steps through the multiples p * m with m also on the wheel. Going from one m
+// to the next adds a fixed number of bytes that only depends on p mod 30 and the position on
+// the wheel, so a prime's place in a window is just (byte, wheel index) and the inner loop
+// is a table lookup, an and and an add. Counting is a popcount over the bytes, 32 at a time
+// with AVX2 when the CPU has it.
+//
+// Windows don't start out all ones: the multiples of 7 to 19 repeat every 7 * 11 * 13 and
+// every 17 * 19 bytes, so a window is the and of those two patterns at the window's phase,
+// 32 or 64 bytes per store with AVX2 or AVX-512. Those primes never get crossed off one by
+// one. The rest go through an unrolled kernel that clears a whole turn of the wheel (8
+// multiples at fixed offsets) per iteration while the turn fits in the window.
+
+#ifndef PRIME_BITMAP_H
+#define PRIME_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <immintrin.h>
+
+#define PRIME_BITMAP_SPAN 30    // integers per byte
+#define PRIME_BITMAP_PRESIEVE_MAX 19    // primes up to this come from the pre-sieve patterns
+#define PRIME_BITMAP_PATTERN_A (7 * 11 * 13)    // bytes before each pattern repeats
+#define PRIME_BITMAP_PATTERN_B (17 * 19)
+#define PRIME_BITMAP_PATTERN_PAD 64     // pattern bytes repeated past the period, for wide loads
+
+static const unsigned char prime_bitmap_residues[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+static const unsigned char prime_bitmap_gaps[8] = { 6, 4, 2, 4, 2, 4, 6, 2 };   // to the next residue
+
+typedef struct {
+    int8_t bit[PRIME_BITMAP_SPAN];          // bit of residue r, -1 when r shares a factor with 30
+    uint8_t next_wheel[PRIME_BITMAP_SPAN];  // first wheel position with residue >= r (8 wraps)
+    uint8_t mask[8][8];             // [p wheel][m wheel]: bit of p * m
+    uint8_t carry[8][8];            // [p wheel][m wheel]: bytes past (p / 30) * gap to the next multiple
+    uint8_t turn_carry[8][8];       // [p wheel][k]: bytes past (p / 30) * (residue k - 1) from a turn's start
+    uint8_t pattern_a[PRIME_BITMAP_PATTERN_A + PRIME_BITMAP_PATTERN_PAD];   // 7, 11 and 13 crossed off
+    uint8_t pattern_b[PRIME_BITMAP_PATTERN_B + PRIME_BITMAP_PATTERN_PAD];   // 17 and 19
+    int ready;
+    int use_avx2;
+    int use_avx512;
+} prime_bitmap_tables_t;
+
+static prime_bitmap_tables_t prime_bitmap_tables;
+
+// Build the lookup tables; call once before any other prime_bitmap function
+static inline void prime_bitmap_init(void) {
+    prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    if (t->ready)
+        return;
+    for (int r = 0; r < PRIME_BITMAP_SPAN; r++)
+        t->bit[r] = -1;
+    for (int b = 0; b < 8; b++)
+        t->bit[prime_bitmap_residues[b]] = (int8_t)b;
+    for (int r = 0; r < PRIME_BITMAP_SPAN; r++) {
+        int w = 0;
+        while (w < 8 && prime_bitmap_residues[w] < r)
+            w++;
+        t->next_wheel[r] = (uint8_t)w;
+    }
+    for (int a = 0; a < 8; a++) {
+        for (int w = 0; w < 8; w++) {
+            int product = prime_bitmap_residues[a] * prime_bitmap_residues[w] % PRIME_BITMAP_SPAN;
+            t->mask[a][w] = (uint8_t)(1u << t->bit[product]);
+            t->carry[a][w] = (uint8_t)((product + prime_bitmap_residues[a] * prime_bitmap_gaps[w]) / PRIME_BITMAP_SPAN);
+        }
+        t->turn_carry[a][0] = 0;
+        for (int k = 1; k < 8; k++)
+            t->turn_carry[a][k] = (uint8_t)(t->turn_carry[a][k - 1] + t->carry[a][k - 1]);
+    }
+
+    static const int pattern_primes[] = { 7, 11, 13, 17, 19 };
+    for (size_t i = 0; i < sizeof(t->pattern_a); i++) {
+        uint8_t byte = 0xff;
+        for (int b = 0; b < 8; b++)
+            for (int k = 0; k < 3; k++)
+                if ((PRIME_BITMAP_SPAN * (i % PRIME_BITMAP_PATTERN_A) + prime_bitmap_residues[b]) % pattern_primes[k] == 0)
+                    byte &= (uint8_t)~(1u << b);
+        t->pattern_a[i] = byte;
+    }
+    for (size_t i = 0; i < sizeof(t->pattern_b); i++) {
+        uint8_t byte = 0xff;
+        for (int b = 0; b < 8; b++)
+            for (int k = 3; k < 5; k++)
+                if ((PRIME_BITMAP_SPAN * (i % PRIME_BITMAP_PATTERN_B) + prime_bitmap_residues[b]) % pattern_primes[k] == 0)
+                    byte &= (uint8_t)~(1u << b);
+        t->pattern_b[i] = byte;
+    }
+
+    t->use_avx2 = __builtin_cpu_supports("avx2");
+    t->use_avx512 = __builtin_cpu_supports("avx512f");
+    t->ready = 1;
+}
+
+// Bytes covering 0..limit
+static inline uint64_t prime_bitmap_bytes(uint64_t limit) {
+    return limit / PRIME_BITMAP_SPAN + 1;
+}
+
+// Whether n has a bit at all, i.e. shares no factor with 30
+static inline int prime_bitmap_holds(uint64_t n) {
+    return prime_bitmap_tables.bit[n % PRIME_BITMAP_SPAN] >= 0;
+}
+
+// Number for byte i, bit b
+static inline uint64_t prime_bitmap_number(uint64_t i, int b) {
+    return PRIME_BITMAP_SPAN * i + prime_bitmap_residues[b];
+}
+
+// Mark every number in bytes [0, bytes) a candidate
+static inline void prime_bitmap_fill(uint8_t* bits, size_t bytes) {
+    memset(bits, 0xff, bytes);
+}
+
+// n must hold a bit (prime_bitmap_holds); bits starts at number 0
+static inline int prime_bitmap_test(const uint8_t* bits, uint64_t n) {
+    return (bits[n / PRIME_BITMAP_SPAN] >> prime_bitmap_tables.bit[n % PRIME_BITMAP_SPAN]) & 1;
+}
+
+static inline void prime_bitmap_clear(uint8_t* bits, uint64_t n) {
+    bits[n / PRIME_BITMAP_SPAN] &= (uint8_t)~(1u << prime_bitmap_tables.bit[n % PRIME_BITMAP_SPAN]);
+}
+
+static inline void prime_bitmap_flip(uint8_t* bits, uint64_t n) {
+    bits[n / PRIME_BITMAP_SPAN] ^= (uint8_t)(1u << prime_bitmap_tables.bit[n % PRIME_BITMAP_SPAN]);
+}
+
+// Clear the bits of the last byte that stand for numbers past limit; the byte holds
+// last_byte * 30 .. last_byte * 30 + 29
+static inline void prime_bitmap_trim(uint8_t* last, uint64_t last_byte, uint64_t limit) {
+    for (int b = 0; b < 8; b++)
+        if (prime_bitmap_number(last_byte, b) > limit)
+            *last &= (uint8_t)~(1u << b);
+}
+
+// Where p (> 5) crosses off first at or past byte low: the multiple p * m with m on the wheel
+// and m >= p. Returns the byte and sets *wheel to m's wheel position.
+static inline uint64_t prime_bitmap_start(uint64_t p, uint64_t low, uint8_t* wheel) {
+    uint64_t m = (low * PRIME_BITMAP_SPAN + p - 1) / p;
+    if (m < p)
+        m = p;
+    uint64_t turn = m / PRIME_BITMAP_SPAN;
+    int w = prime_bitmap_tables.next_wheel[m % PRIME_BITMAP_SPAN];
+    if (w == 8) {
+        turn++;
+        w = 0;
+    }
+    *wheel = (uint8_t)w;
+    return p * (turn * PRIME_BITMAP_SPAN + prime_bitmap_residues[w]) / PRIME_BITMAP_SPAN;
+}
+
+// Clear p's multiples in a window of bytes whose first byte is *next's origin: *next is the
+// byte of the next multiple relative to the window and *wheel its wheel position. Both are
+// left pointing past the window (relative to its end).
+static inline void prime_bitmap_cross_off(uint8_t* bits, size_t bytes, uint64_t p, uint64_t* next, uint8_t* wheel) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    int a = t->bit[p % PRIME_BITMAP_SPAN];
+    uint64_t q = p / PRIME_BITMAP_SPAN;
+    const uint8_t* mask = t->mask[a];
+    const uint8_t* carry = t->carry[a];
+    uint64_t i = *next;
+    int w = *wheel;
+    while (i < bytes) {
+        bits[i] &= (uint8_t)~mask[w];
+        i += q * prime_bitmap_gaps[w] + carry[w];
+        w = (w + 1) & 7;
+    }
+    *next = i - bytes;
+    *wheel = (uint8_t)w;
+}
+
+// The same multiples, a wheel turn per iteration: with the turn starting at byte i, the k-th
+// multiple is at i + (p / 30) * (residue k - 1) + turn_carry, and the next turn is p bytes on
+static inline void prime_bitmap_cross_off_unrolled(uint8_t* bits, size_t bytes, uint64_t p, uint64_t* next, uint8_t* wheel) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    int a = t->bit[p % PRIME_BITMAP_SPAN];
+    uint64_t q = p / PRIME_BITMAP_SPAN;
+    const uint8_t* mask = t->mask[a];
+    const uint8_t* carry = t->carry[a];
+    uint64_t i = *next;
+    int w = *wheel;
+    while (w != 0 && i < bytes) {
+        bits[i] &= (uint8_t)~mask[w];
+        i += q * prime_bitmap_gaps[w] + carry[w];
+        w = (w + 1) & 7;
+    }
+
+    const uint8_t* turn_carry = t->turn_carry[a];
+    uint64_t o1 = q * 6 + turn_carry[1], o2 = q * 10 + turn_carry[2], o3 = q * 12 + turn_carry[3];
+    uint64_t o4 = q * 16 + turn_carry[4], o5 = q * 18 + turn_carry[5], o6 = q * 22 + turn_carry[6];
+    uint64_t o7 = q * 28 + turn_carry[7];
+    uint8_t m0 = (uint8_t)~mask[0], m1 = (uint8_t)~mask[1], m2 = (uint8_t)~mask[2], m3 = (uint8_t)~mask[3];
+    uint8_t m4 = (uint8_t)~mask[4], m5 = (uint8_t)~mask[5], m6 = (uint8_t)~mask[6], m7 = (uint8_t)~mask[7];
+    if (w == 0) {
+        for (; i + o7 < bytes; i += p) {
+            bits[i] &= m0;
+            bits[i + o1] &= m1;
+            bits[i + o2] &= m2;
+            bits[i + o3] &= m3;
+            bits[i + o4] &= m4;
+            bits[i + o5] &= m5;
+            bits[i + o6] &= m6;
+            bits[i + o7] &= m7;
+        }
+    }
+
+    while (i < bytes) {
+        bits[i] &= (uint8_t)~mask[w];
+        i += q * prime_bitmap_gaps[w] + carry[w];
+        w = (w + 1) & 7;
+    }
+    *next = i - bytes;
+    *wheel = (uint8_t)w;
+}
+
+// Pre-sieve kernels: out[i] = pattern_a[phase] & pattern_b[phase], width bytes per step.
+// They return how many bytes they filled; the caller finishes the tail.
+static inline size_t prime_bitmap_presieve_words(uint8_t* bits, size_t bytes, size_t* ia, size_t* ib) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, t->pattern_a + *ia, 8);
+        memcpy(&b, t->pattern_b + *ib, 8);
+        a &= b;
+        memcpy(bits + i, &a, 8);
+        if ((*ia += 8) >= PRIME_BITMAP_PATTERN_A) *ia -= PRIME_BITMAP_PATTERN_A;
+        if ((*ib += 8) >= PRIME_BITMAP_PATTERN_B) *ib -= PRIME_BITMAP_PATTERN_B;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline size_t prime_bitmap_presieve_avx2(uint8_t* bits, size_t bytes, size_t* ia, size_t* ib) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(t->pattern_a + *ia));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(t->pattern_b + *ib));
+        _mm256_storeu_si256((__m256i*)(bits + i), _mm256_and_si256(a, b));
+        if ((*ia += 32) >= PRIME_BITMAP_PATTERN_A) *ia -= PRIME_BITMAP_PATTERN_A;
+        if ((*ib += 32) >= PRIME_BITMAP_PATTERN_B) *ib -= PRIME_BITMAP_PATTERN_B;
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static inline size_t prime_bitmap_presieve_avx512(uint8_t* bits, size_t bytes, size_t* ia, size_t* ib) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m512i a = _mm512_loadu_si512((const void*)(t->pattern_a + *ia));
+        __m512i b = _mm512_loadu_si512((const void*)(t->pattern_b + *ib));
+        _mm512_storeu_si512((void*)(bits + i), _mm512_and_si512(a, b));
+        if ((*ia += 64) >= PRIME_BITMAP_PATTERN_A) *ia -= PRIME_BITMAP_PATTERN_A;
+        if ((*ib += 64) >= PRIME_BITMAP_PATTERN_B) *ib -= PRIME_BITMAP_PATTERN_B;
+    }
+    return i;
+}
+
+// Start a window of bytes beginning at byte low with 7 to 19 already crossed off. The window
+// holding those primes gets them back.
+static inline void prime_bitmap_presieve(uint8_t* bits, size_t bytes, uint64_t low) {
+    const prime_bitmap_tables_t* t = &prime_bitmap_tables;
+    size_t ia = (size_t)(low % PRIME_BITMAP_PATTERN_A);
+    size_t ib = (size_t)(low % PRIME_BITMAP_PATTERN_B);
+    size_t i;
+    if (t->use_avx512)
+        i = prime_bitmap_presieve_avx512(bits, bytes, &ia, &ib);
+    else if (t->use_avx2)
+        i = prime_bitmap_presieve_avx2(bits, bytes, &ia, &ib);
+    else
+        i = prime_bitmap_presieve_words(bits, bytes, &ia, &ib);
+    for (; i < bytes; i++) {
+        bits[i] = t->pattern_a[ia] & t->pattern_b[ib];
+        if (++ia == PRIME_BITMAP_PATTERN_A) ia = 0;
+        if (++ib == PRIME_BITMAP_PATTERN_B) ib = 0;
+    }
+    if (low == 0 && bytes > 0)
+        bits[0] |= 0x3e;    // 7, 11, 13, 17 and 19 themselves
+}
+
+static inline uint64_t prime_bitmap_count_scalar(const uint8_t* bits, size_t bytes) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, bits + i, 8);
+        count += (uint64_t)__builtin_popcountll(word);
+    }
+    for (; i < bytes; i++)
+        count += (uint64_t)__builtin_popcount(bits[i]);
+    return count;
+}
+
+// Nibble lookup popcount (Mula's): pshufb counts each nibble, psadbw sums the bytes
+__attribute__((target("avx2")))
+static inline uint64_t prime_bitmap_count_avx2(const uint8_t* bits, size_t bytes) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= bytes) {
+        // byte counts reach at most 8 per step, so 31 steps fit in a byte before the wide sum
+        __m256i sum = _mm256_setzero_si256();
+        for (int step = 0; step < 31 && i + 32 <= bytes; step++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(bits + i));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low_nibble));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble));
+            sum = _mm256_add_epi8(sum, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(sum, _mm256_setzero_si256()));
+    }
+    uint64_t count = (uint64_t)_mm256_extract_epi64(total, 0) + (uint64_t)_mm256_extract_epi64(total, 1) +
+                     (uint64_t)_mm256_extract_epi64(total, 2) + (uint64_t)_mm256_extract_epi64(total, 3);
+    return count + prime_bitmap_count_scalar(bits + i, bytes - i);
+}
+
+// Candidates left in bytes [0, bytes)
+static inline uint64_t prime_bitmap_count(const uint8_t* bits, size_t bytes) {
+    if (prime_bitmap_tables.use_avx2)
+        return prime_bitmap_count_avx2(bits, bytes);
+    return prime_bitmap_count_scalar(bits, bytes);
+}
+
+#endif
@@ -9,6 +9,10 @@
 #include <time.h>
 #include <getopt.h>
 
+#include "primality.h"
+#include "gmp-alloc.h"
+#include "radix-convert.h"
+
 #define MAX_THREADS 64
 #define MILLER_RABIN_ITERATIONS 40
 #define UPDATE_INTERVAL 1000000 // Update status every 1 million checks
@@ -36,68 +40,22 @@ int num_threads;
 int target_length;
 unsigned long long primes_checked = 0;
 time_t start_time;
+int output_format = RADIX_DECIMAL;  // how the largest prime is written out
 
 void handle_sigint(int sig) {
     keep_running = 0;
 }
 
-int miller_rabin(mpz_t n, int iterations) {
-    if (mpz_cmp_ui(n, 2) < 0)
-        return 0;
-    if (mpz_cmp_ui(n, 2) == 0)
-        return 1;
-    if (mpz_even_p(n))
-        return 0;
-
-    mpz_t a, y, j, r, n_minus_one;
-    mpz_inits(a, y, j, r, n_minus_one, NULL);
-
-    unsigned long int s = 0;
-    mpz_sub_ui(n_minus_one, n, 1);
-    mpz_set(r, n_minus_one);
-
-    while (mpz_even_p(r)) {
-        mpz_fdiv_q_2exp(r, r, 1);
-        s++;
-    }
-
-    gmp_randstate_t rnd;
-    gmp_randinit_default(rnd);
-    gmp_randseed_ui(rnd, time(NULL));
-
-    int is_prime = 1;
-    for (int i = 0; i < iterations && is_prime; i++) {
-        mpz_urandomm(a, rnd, n_minus_one);
-        mpz_add_ui(a, a, 1);
-        mpz_powm(y, a, r, n);
-
-        if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_one) != 0) {
-            for (unsigned long int j = 1; j < s && mpz_cmp(y, n_minus_one) != 0; j++) {
-                mpz_powm_ui(y, y, 2, n);
-                if (mpz_cmp_ui(y, 1) == 0) {
-                    is_prime = 0;
-                    break;
-                }
-            }
-            if (mpz_cmp(y, n_minus_one) != 0) {
-                is_prime = 0;
-            }
-        }
-    }
-
-    mpz_clears(a, y, j, r, n_minus_one, NULL);
-    gmp_randclear(rnd);
-    return is_prime;
-}
-
 void* find_primes(void* arg) {
     thread_data_t* data = (thread_data_t*)arg;
+    primality_ctx_t ctx;
+    primality_ctx_init(&ctx, data->thread_id);
     mpz_t candidate;
     mpz_init(candidate);
     mpz_set(candidate, data->start);
 
     while (keep_running) {
-        if (miller_rabin(candidate, MILLER_RABIN_ITERATIONS)) {
+        if (primality_miller_rabin(&ctx, candidate, MILLER_RABIN_ITERATIONS)) {
             pthread_mutex_lock(&prime_mutex);
             if (mpz_cmp(candidate, current_prime) > 0) {
                 mpz_set(current_prime, candidate);
@@ -118,25 +76,42 @@ void* find_primes(void* arg) {
     }
 
     mpz_clear(candidate);
+    primality_ctx_clear(&ctx);
     return NULL;
 }
 
 void print_status() {
-    char* prime_str = mpz_get_str(NULL, 10, current_prime);
-    int current_length = strlen(prime_str);
+    pthread_mutex_lock(&prime_mutex);
+    int current_length = (int)radix_decimal_digits(current_prime);
+    pthread_mutex_unlock(&prime_mutex);
     double percentage = (double)current_length / target_length * 100;
     time_t current_time = time(NULL);
     double elapsed_time = difftime(current_time, start_time);
     double primes_per_second = primes_checked / elapsed_time;
 
-    printf(ANSI_COLOR_CYAN "\rCurrent prime length: %d/%d | " ANSI_COLOR_YELLOW "%.2f%% complete | " ANSI_COLOR_GREEN "%.2f primes/second" ANSI_COLOR_RESET, 
-           current_length, target_length, percentage, primes_per_second);
+    gmp_alloc_stats_t gmp_stats;
+    gmp_alloc_get_stats(&gmp_stats);
+
+    printf(ANSI_COLOR_CYAN "\rCurrent prime length: %d/%d | " ANSI_COLOR_YELLOW "%.2f%% complete | " ANSI_COLOR_GREEN "%.2f primes/second" ANSI_COLOR_RESET
+           " | GMP: %.1f MB live, %.1f MB peak, %.0f allocs/s",
+           current_length, target_length, percentage, primes_per_second,
+           gmp_stats.live / 1048576.0, gmp_stats.peak / 1048576.0, gmp_stats.allocations / elapsed_time);
     fflush(stdout);
+}
 
-    free(prime_str);
+void print_largest() {
+    printf("\n\nLargest prime found: ");
+    if (output_format == RADIX_BINARY) {
+        if (radix_write_file("largest_prime.bin", current_prime, RADIX_BINARY, num_threads) == 0)
+            printf("written to largest_prime.bin");
+    } else {
+        radix_print(stdout, current_prime, output_format, num_threads);
+    }
+    printf("\n");
 }
 
 int main(int argc, char* argv[]) {
+    gmp_alloc_install();
     num_threads = 1;
     target_length = 1000;
     mpz_t initial_number;
@@ -144,7 +119,7 @@ int main(int argc, char* argv[]) {
     mpz_set_ui(initial_number, 2);  // Default starting point
 
     int opt;
-    while ((opt = getopt(argc, argv, "t:p:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "t:p:i:f:")) != -1) {
         switch (opt) {
             case 't':
                 num_threads = atoi(optarg);
@@ -155,8 +130,15 @@ int main(int argc, char* argv[]) {
             case 'i':
                 mpz_set_str(initial_number, optarg, 10);
                 break;
+            case 'f':
+                output_format = radix_parse_format(optarg);
+                if (output_format < 0) {
+                    fprintf(stderr, "Unknown output format '%s' (expected dec, hex or bin)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -t <num_threads> -p <target_length> [-i <initial_number>]\n", argv[0]);
+                fprintf(stderr, "Usage: %s -t <num_threads> -p <target_length> [-i <initial_number>] [-f dec|hex|bin]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -206,9 +188,7 @@ int main(int argc, char* argv[]) {
         pthread_join(threads[i], NULL);
     }
 
-    printf("\n\nLargest prime found: ");
-    mpz_out_str(stdout, 10, current_prime);
-    printf("\n");
+    print_largest();
 
     if (mpz_cmp(current_prime, target_prime) >= 0) {
         printf("Target length reached. Continue? (y/n): ");
@@ -246,9 +226,7 @@ int main(int argc, char* argv[]) {
                 pthread_join(threads[i], NULL);
             }
 
-            printf("\n\nLargest prime found: ");
-            mpz_out_str(stdout, 10, current_prime);
-            printf("\n");
+            print_largest();
         }
     }
 
@@ -0,0 +1,133 @@
+// Per-thread progress counters and the status thread that reports them.
+//
+// Each worker owns one cache-line sized slot and bumps its counters with plain relaxed
+// stores, so counting an exponent never bounces a shared line between cores. A status
+// thread wakes on a CLOCK_MONOTONIC timer, sums the slots and calls the program's report
+// function; workers never print status themselves.
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Counters kept per worker
+#define PROGRESS_CHECKED 0          // exponents settled, whichever way
+#define PROGRESS_TRIAL_FACTORED 1   // settled by trial factoring
+#define PROGRESS_PM1 2              // settled by P-1
+#define PROGRESS_FULL_TESTS 3       // went through a full primality test
+#define PROGRESS_LEDGER 4           // skipped because the ledger already had an answer
+#define PROGRESS_COUNTERS 5
+
+typedef struct {
+    unsigned long long counts[PROGRESS_COUNTERS];
+} __attribute__((aligned(64))) progress_slot_t;
+
+typedef struct progress {
+    progress_slot_t* slots;         // one per worker
+    int count;
+    double start;                   // monotonic seconds when counting started
+    double interval;                // seconds between reports
+    void (*report)(struct progress*);
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+} progress_t;
+
+static inline double progress_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void progress_init(progress_t* progress, int count, double interval) {
+    void* slots = NULL;
+    if (posix_memalign(&slots, 64, count * sizeof(progress_slot_t)) != 0) {
+        perror("Failed to allocate progress counters");
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, 0, count * sizeof(progress_slot_t));
+    progress->slots = (progress_slot_t*)slots;
+    progress->count = count;
+    progress->start = progress_now();
+    progress->interval = interval;
+    progress->report = NULL;
+    progress->stopping = 0;
+    pthread_mutex_init(&progress->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress->wake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static inline void progress_clear(progress_t* progress) {
+    pthread_cond_destroy(&progress->wake);
+    pthread_mutex_destroy(&progress->lock);
+    free(progress->slots);
+}
+
+// Only the worker owning slot may call this
+static inline void progress_add(progress_t* progress, int slot, int counter, unsigned long long n) {
+    unsigned long long* count = &progress->slots[slot].counts[counter];
+    __atomic_store_n(count, *count + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long progress_count(const progress_t* progress, int slot, int counter) {
+    return __atomic_load_n(&progress->slots[slot].counts[counter], __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long progress_total(const progress_t* progress, int counter) {
+    unsigned long long total = 0;
+    for (int i = 0; i < progress->count; i++)
+        total += progress_count(progress, i, counter);
+    return total;
+}
+
+static inline double progress_elapsed(const progress_t* progress) {
+    return progress_now() - progress->start;
+}
+
+static inline void* progress_thread(void* arg) {
+    progress_t* progress = (progress_t*)arg;
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->stopping) {
+        double next = progress_now() + progress->interval;
+        struct timespec deadline;
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - (double)deadline.tv_sec) * 1e9);
+        while (!progress->stopping && pthread_cond_timedwait(&progress->wake, &progress->lock, &deadline) == 0)
+            ;
+        pthread_mutex_unlock(&progress->lock);
+        progress->report(progress);
+        pthread_mutex_lock(&progress->lock);
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+// Call report every interval seconds from a thread of its own until progress_stop
+static inline void progress_start(progress_t* progress, void (*report)(progress_t*)) {
+    progress->report = report;
+    progress->start = progress_now();
+    if (pthread_create(&progress->thread, NULL, progress_thread, progress) != 0) {
+        perror("Failed to create status thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Stop the status thread; it reports once more on the way out
+static inline void progress_stop(progress_t* progress) {
+    pthread_mutex_lock(&progress->lock);
+    progress->stopping = 1;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->lock);
+    pthread_join(progress->thread, NULL);
+}
+
+#endif
@@ -0,0 +1,341 @@
+// Pietrzak proofs for base-3 PRP tests of 2^p - 1.
+//
+// A PRP test computes y = 3^(2^p). The proof lets anyone check that claim with a few percent
+// of the squarings. Each of `power` halving steps takes a claim y = x^(2^T), the prover sends
+// the midpoint u = x^(2^(T/2)), and both sides turn it into the half-length claim
+// y' = x'^(2^(T/2)) with x' = x^r * u and y' = u^r * y, where r is taken from a SHA-256 chain
+// over p, y and every u so far. When T is odd the verifier first squares x itself. After the
+// last step the verifier squares x' about p / 2^power times and compares with y'.
+//
+// Every u is a product of residues of the original squaring chain raised to products of the
+// r values, and which residues are needed depends only on p and power. So the test saves
+// those 2^power - 1 residues to disk as it passes them, and the prover combines them at the
+// end. Disk use is (2^power - 1) residues of p bits; power is picked to fit a budget.
+//
+// Proof file: prp_proof_header_t, then y, then u_1 .. u_power, each `limbs` raw limbs.
+
+#ifndef PRP_PROOF_H
+#define PRP_PROOF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#include "mersenne-mod.h"
+
+#define PROOF_DIR "proofs"
+#define PROOF_MAGIC 0x46504d4dU     // "MMPF"
+#define PROOF_MAX_POWER 10
+
+typedef struct {
+    uint32_t magic;
+    uint32_t power;
+    uint64_t exponent;
+    uint64_t limbs;
+} prp_proof_header_t;
+
+typedef struct {
+    unsigned long p;
+    unsigned int power;
+    unsigned long* mids;        // level k uses mids[2^k - 1 .. 2^(k+1) - 1), in tree order
+    unsigned long* sorted;      // the same positions in increasing order
+    size_t count;               // 2^power - 1
+    char dir[256];              // where the residues live until the proof is written
+} prp_proof_t;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline void sha256_compress(sha256_t* ctx, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static inline void sha256_init(sha256_t* ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static inline void sha256_update(sha256_t* ctx, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    ctx->length += size;
+    while (size > 0) {
+        size_t take = 64 - ctx->used < size ? 64 - ctx->used : size;
+        memcpy(ctx->block + ctx->used, bytes, take);
+        ctx->used += take;
+        bytes += take;
+        size -= take;
+        if (ctx->used == 64) {
+            sha256_compress(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static inline void sha256_final(sha256_t* ctx, unsigned char digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56)
+        sha256_update(ctx, &pad, 1);
+    unsigned char length[8];
+    for (int i = 0; i < 8; i++)
+        length[i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(ctx, length, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// Start of the hash chain: binds p, power and the claimed y
+static inline void prp_proof_hash_start(unsigned char hash[32], unsigned long p, unsigned int power, const mp_limb_t* y, mp_size_t n) {
+    sha256_t ctx;
+    uint64_t fields[2] = { p, power };
+    sha256_init(&ctx);
+    sha256_update(&ctx, fields, sizeof(fields));
+    sha256_update(&ctx, y, n * sizeof(mp_limb_t));
+    sha256_final(&ctx, hash);
+}
+
+// Fold the next midpoint into the chain and return the challenge r for this step
+static inline uint64_t prp_proof_hash_step(unsigned char hash[32], const mp_limb_t* u, mp_size_t n) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, hash, 32);
+    sha256_update(&ctx, u, n * sizeof(mp_limb_t));
+    sha256_final(&ctx, hash);
+
+    uint64_t r = 0;
+    for (int i = 0; i < 8; i++)
+        r = r << 8 | hash[i];
+    return r | 1;
+}
+
+// rp = ap^e mod N; rp must not alias ap
+static inline void prp_proof_pow(special_mod_t* mod, mp_limb_t* rp, const mp_limb_t* ap, uint64_t e) {
+    memcpy(rp, ap, mod->n * sizeof(mp_limb_t));
+    for (int bit = 62 - __builtin_clzll(e); bit >= 0; bit--) {
+        special_mod_sqr(mod, rp, rp);
+        if ((e >> bit) & 1)
+            special_mod_mul(mod, rp, rp, ap);
+    }
+}
+
+// Largest power whose residues fit in budget bytes, leaving at least min_tail iterations per
+// final segment. 0 means no proof.
+static inline unsigned int prp_proof_power(unsigned long p, unsigned long min_tail, size_t budget) {
+    size_t residue_bytes = (p + 7) / 8;
+    unsigned int power = 0;
+    while (power < PROOF_MAX_POWER
+           && (((size_t)2 << power) - 1) * residue_bytes <= budget
+           && (p >> (power + 1)) >= min_tail)
+        power++;
+    return power;
+}
+
+static inline int prp_proof_compare(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static inline void prp_proof_init(prp_proof_t* proof, unsigned long p, unsigned int power) {
+    proof->p = p;
+    proof->power = power;
+    proof->count = ((size_t)1 << power) - 1;
+    proof->mids = (unsigned long*)malloc(proof->count * sizeof(unsigned long));
+    proof->sorted = (unsigned long*)malloc(proof->count * sizeof(unsigned long));
+    snprintf(proof->dir, sizeof(proof->dir), PROOF_DIR "/%lu.residues", p);
+
+    // Segment starts of the current claim; an odd length shifts every start by one squaring
+    unsigned long* starts = (unsigned long*)calloc((size_t)1 << power, sizeof(unsigned long));
+    unsigned long length = p;
+    for (unsigned int k = 0; k < power; k++) {
+        size_t segments = (size_t)1 << k;
+        if (length & 1) {
+            for (size_t j = 0; j < segments; j++)
+                starts[j]++;
+            length--;
+        }
+        unsigned long half = length / 2;
+        unsigned long* level = proof->mids + segments - 1;
+        for (size_t j = segments; j-- > 0; ) {
+            level[j] = starts[j] + half;
+            starts[2 * j + 1] = starts[j] + half;
+            starts[2 * j] = starts[j];
+        }
+        length = half;
+    }
+    free(starts);
+
+    memcpy(proof->sorted, proof->mids, proof->count * sizeof(unsigned long));
+    qsort(proof->sorted, proof->count, sizeof(unsigned long), prp_proof_compare);
+
+    mkdir(PROOF_DIR, 0755);
+    if (mkdir(proof->dir, 0755) != 0 && errno != EEXIST)
+        perror("Failed to create proof residue directory");
+}
+
+static inline void prp_proof_clear(prp_proof_t* proof) {
+    free(proof->mids);
+    free(proof->sorted);
+}
+
+// First position after iteration i that needs a residue, or ULONG_MAX
+static inline unsigned long prp_proof_next_position(const prp_proof_t* proof, unsigned long i) {
+    size_t lo = 0, hi = proof->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (proof->sorted[mid] <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < proof->count ? proof->sorted[lo] : (unsigned long)-1;
+}
+
+static inline void prp_proof_residue_path(const prp_proof_t* proof, char* path, size_t size, unsigned long i) {
+    snprintf(path, size, "%s/%lu.res", proof->dir, i);
+}
+
+// Save x if iteration i is one of the positions the proof needs
+static inline void prp_proof_save_residue(const prp_proof_t* proof, unsigned long i, const mp_limb_t* x, mp_size_t n) {
+    if (!bsearch(&i, proof->sorted, proof->count, sizeof(unsigned long), prp_proof_compare))
+        return;
+    char path[320];
+    prp_proof_residue_path(proof, path, sizeof(path), i);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL || fwrite(x, sizeof(mp_limb_t), n, file) != (size_t)n)
+        perror("Failed to save proof residue");
+    if (file != NULL)
+        fclose(file);
+}
+
+static inline int prp_proof_load_residue(const prp_proof_t* proof, unsigned long i, mp_limb_t* x, mp_size_t n) {
+    char path[320];
+    prp_proof_residue_path(proof, path, sizeof(path), i);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+    int ok = fread(x, sizeof(mp_limb_t), n, file) == (size_t)n;
+    fclose(file);
+    return ok;
+}
+
+// rp = prod mids[j]^e_j over count residues of one level starting at mids, where the exponents
+// are the products of r[depth..] picked by the tree position. Returns 0 if a residue is missing.
+static inline int prp_proof_combine(const prp_proof_t* proof, special_mod_t* mod, mp_limb_t* rp,
+                             const unsigned long* mids, size_t count, const uint64_t* r) {
+    if (count == 1)
+        return prp_proof_load_residue(proof, mids[0], rp, mod->n);
+
+    mp_limb_t* left = special_mod_alloc(mod);
+    mp_limb_t* right = special_mod_alloc(mod);
+    int ok = prp_proof_combine(proof, mod, left, mids, count / 2, r + 1)
+          && prp_proof_combine(proof, mod, right, mids + count / 2, count / 2, r + 1);
+    if (ok) {
+        prp_proof_pow(mod, rp, left, r[0]);
+        special_mod_mul(mod, rp, rp, right);
+    }
+    free(left);
+    free(right);
+    return ok;
+}
+
+// Build proofs/<p>.proof for the final residue y and remove the saved residues.
+// Returns 0 on success, -1 when a residue is missing or the file cannot be written.
+static inline int prp_proof_write(prp_proof_t* proof, special_mod_t* mod, const mp_limb_t* y) {
+    mp_size_t n = mod->n;
+    unsigned int power = proof->power;
+    mp_limb_t* u = (mp_limb_t*)calloc((size_t)power * n, sizeof(mp_limb_t));
+    uint64_t r[PROOF_MAX_POWER];
+    unsigned char hash[32];
+
+    prp_proof_hash_start(hash, proof->p, power, y, n);
+    int ok = 1;
+    for (unsigned int k = 0; k < power && ok; k++) {
+        size_t segments = (size_t)1 << k;
+        ok = prp_proof_combine(proof, mod, u + k * n, proof->mids + segments - 1, segments, r);
+        if (ok)
+            r[k] = prp_proof_hash_step(hash, u + k * n, n);
+    }
+
+    if (ok) {
+        char path[256], tmp_path[272];
+        snprintf(path, sizeof(path), PROOF_DIR "/%lu.proof", proof->p);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        prp_proof_header_t header = { PROOF_MAGIC, power, proof->p, (uint64_t)n };
+        FILE* file = fopen(tmp_path, "wb");
+        ok = file != NULL
+          && fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(y, sizeof(mp_limb_t), n, file) == (size_t)n
+          && fwrite(u, sizeof(mp_limb_t), (size_t)power * n, file) == (size_t)power * n;
+        if (file != NULL)
+            ok = fclose(file) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok)
+            perror("Failed to write proof file");
+    } else {
+        fprintf(stderr, "\nMissing proof residues for 2^%lu - 1, no proof written\n", proof->p);
+    }
+
+    for (size_t i = 0; i < proof->count; i++) {
+        char path[320];
+        prp_proof_residue_path(proof, path, sizeof(path), proof->sorted[i]);
+        unlink(path);
+    }
+    rmdir(proof->dir);
+
+    free(u);
+    return ok ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+#include "prp-proof.h"
+#include "gmp-alloc.h"
+
+// ANSI color codes
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+unsigned long fft_crossover = 0;
+
+// x = x^(2^count) mod 2^p - 1, on the IBDWT above the crossover
+void square_repeatedly(special_mod_t* mod, mp_limb_t* x, unsigned long count) {
+    if (mod->p >= fft_crossover) {
+        ibdwt_iterate(mod, x, count, 1, 0, NULL);
+    } else {
+        for (unsigned long i = 0; i < count; i++)
+            special_mod_sqr(mod, x, x);
+    }
+}
+
+// Check a proof written by a PRP test. Returns 1 if it holds, 0 if it does not, -1 if the
+// file can't be read. On success *is_prp says whether 2^p - 1 is a probable prime.
+int verify_proof(const char* path, unsigned long* exponent, int* is_prp) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Failed to open proof file");
+        return -1;
+    }
+
+    prp_proof_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != PROOF_MAGIC
+        || header.power < 1 || header.power > PROOF_MAX_POWER || header.exponent < 3) {
+        fprintf(stderr, "%s is not a proof file\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    unsigned long p = (unsigned long)header.exponent;
+    unsigned int power = header.power;
+    special_mod_t mod;
+    special_mod_init(&mod, p, 1);
+    mp_size_t n = mod.n;
+    if (header.limbs != (uint64_t)n) {
+        fprintf(stderr, "%s has the wrong residue size for 2^%lu - 1\n", path, p);
+        special_mod_clear(&mod);
+        fclose(file);
+        return -1;
+    }
+
+    mp_limb_t* state = (mp_limb_t*)calloc((size_t)(power + 3) * n, sizeof(mp_limb_t));
+    mp_limb_t* y = state;
+    mp_limb_t* u = state + n;
+    mp_limb_t* x = state + (size_t)(power + 1) * n;
+    mp_limb_t* t = x + n;
+    int ok = fread(y, sizeof(mp_limb_t), (size_t)(power + 1) * n, file) == (size_t)(power + 1) * n;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s is truncated\n", path);
+        free(state);
+        special_mod_clear(&mod);
+        return -1;
+    }
+
+    special_mod_set_ui(&mod, t, 9);
+    *is_prp = mpn_cmp(y, t, n) == 0;
+    *exponent = p;
+
+    // Halve the claim y = x^(2^length) power times, squaring x first whenever length is odd
+    unsigned char hash[32];
+    prp_proof_hash_start(hash, p, power, y, n);
+    special_mod_set_ui(&mod, x, 3);
+    unsigned long length = p;
+    for (unsigned int k = 0; k < power; k++) {
+        mp_limb_t* uk = u + (size_t)k * n;
+        if (length & 1) {
+            special_mod_sqr(&mod, x, x);
+            length--;
+        }
+        uint64_t r = prp_proof_hash_step(hash, uk, n);
+        prp_proof_pow(&mod, t, x, r);
+        special_mod_mul(&mod, x, t, uk);
+        prp_proof_pow(&mod, t, uk, r);
+        special_mod_mul(&mod, y, t, y);
+        length /= 2;
+    }
+
+    square_repeatedly(&mod, x, length);
+    int valid = mpn_cmp(x, y, n) == 0;
+
+    free(state);
+    special_mod_clear(&mod);
+    return valid;
+}
+
+int main(int argc, char* argv[]) {
+    gmp_alloc_install();
+    int opt;
+    while ((opt = getopt(argc, argv, "x:")) != -1) {
+        switch (opt) {
+            case 'x':
+                fft_crossover = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-x <fft_crossover>] <proof_file>...\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-x <fft_crossover>] <proof_file>...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fft_crossover == 0)
+        fft_crossover = ibdwt_measure_crossover();
+
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        unsigned long p;
+        int is_prp;
+        time_t start = time(NULL);
+        int valid = verify_proof(argv[i], &p, &is_prp);
+        if (valid < 0) {
+            failures++;
+        } else if (valid == 0) {
+            printf(ANSI_COLOR_RED "%s: proof for 2^%lu - 1 is INVALID" ANSI_COLOR_RESET "\n", argv[i], p);
+            failures++;
+        } else {
+            printf(ANSI_COLOR_GREEN "%s: proof for 2^%lu - 1 holds, %s" ANSI_COLOR_RESET " (%ld s)\n",
+                   argv[i], p, is_prp ? "probable prime" : "composite", (long)(time(NULL) - start));
+        }
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,204 @@
+// Base conversion for big results: decimal by divide and conquer across threads, hex, or raw bytes.
+//
+// Decimal splits x = q * 10^D + r with D = RADIX_LEAF_DIGITS * 2^k, the largest such power
+// below the digit count, and writes q and r into the two ends of one buffer, r zero padded to
+// exactly D digits. The powers 10^D are computed once and kept for later numbers. With fast
+// division the whole conversion costs a few multiplications of the full size, and the two
+// halves of each split run on different threads until the threads run out. Pieces of at most
+// RADIX_LEAF_DIGITS digits go to mpz_get_str.
+//
+// Output goes into one preallocated buffer, or straight into an mmap'd file, so a number with
+// millions of digits is never copied through stdio piece by piece.
+
+#ifndef RADIX_CONVERT_H
+#define RADIX_CONVERT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gmp.h>
+
+#define RADIX_LEAF_DIGITS 2048  // digits converted directly by mpz_get_str
+#define RADIX_MAX_LEVELS 48     // 10^(RADIX_LEAF_DIGITS * 2^47) is far past any mpz
+
+// Output formats
+#define RADIX_DECIMAL 0
+#define RADIX_HEX 1
+#define RADIX_BINARY 2          // big-endian bytes, no leading zero bytes
+
+static mpz_t radix_powers[RADIX_MAX_LEVELS];    // radix_powers[k] = 10^(RADIX_LEAF_DIGITS << k)
+static int radix_power_count = 0;
+static pthread_mutex_t radix_power_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char* out;
+    const mpz_t* x;
+    size_t digits;
+    int threads;
+} radix_job_t;
+
+// "dec", "hex" or "bin", -1 for anything else
+static inline int radix_parse_format(const char* name) {
+    if (strcmp(name, "dec") == 0)
+        return RADIX_DECIMAL;
+    if (strcmp(name, "hex") == 0)
+        return RADIX_HEX;
+    if (strcmp(name, "bin") == 0)
+        return RADIX_BINARY;
+    return -1;
+}
+
+// Make sure every power needed for digits is cached; returns how many levels there are
+static inline int radix_powers_for(size_t digits) {
+    pthread_mutex_lock(&radix_power_lock);
+    if (radix_power_count == 0) {
+        mpz_init(radix_powers[0]);
+        mpz_ui_pow_ui(radix_powers[0], 10, RADIX_LEAF_DIGITS);
+        radix_power_count = 1;
+    }
+    while (radix_power_count < RADIX_MAX_LEVELS && ((size_t)RADIX_LEAF_DIGITS << (radix_power_count - 1)) * 2 < digits) {
+        mpz_init(radix_powers[radix_power_count]);
+        mpz_mul(radix_powers[radix_power_count], radix_powers[radix_power_count - 1], radix_powers[radix_power_count - 1]);
+        radix_power_count++;
+    }
+    int count = radix_power_count;
+    pthread_mutex_unlock(&radix_power_lock);
+    return count;
+}
+
+static inline void* radix_decimal_job(void* arg);
+
+// Write x < 10^digits as exactly digits decimal digits, zero padded on the left
+static inline void radix_decimal(char* out, const mpz_t x, size_t digits, int threads) {
+    if (digits <= RADIX_LEAF_DIGITS) {
+        char leaf[RADIX_LEAF_DIGITS + 2];
+        mpz_get_str(leaf, 10, x);
+        size_t length = strlen(leaf);
+        if (length == 1 && leaf[0] == '0')
+            length = 0;
+        memset(out, '0', digits - length);
+        memcpy(out + digits - length, leaf, length);
+        return;
+    }
+
+    int k = 0;
+    while (((size_t)RADIX_LEAF_DIGITS << (k + 1)) < digits)
+        k++;
+    size_t low_digits = (size_t)RADIX_LEAF_DIGITS << k;
+
+    mpz_t q, r;
+    mpz_inits(q, r, NULL);
+    mpz_tdiv_qr(q, r, x, radix_powers[k]);
+
+    pthread_t helper;
+    radix_job_t job = {out, (const mpz_t*)&q, digits - low_digits, threads / 2};
+    int helped = threads > 1 && pthread_create(&helper, NULL, radix_decimal_job, &job) == 0;
+    if (!helped)
+        radix_decimal(out, q, digits - low_digits, 1);
+    radix_decimal(out + digits - low_digits, r, low_digits, helped ? threads - threads / 2 : 1);
+    if (helped)
+        pthread_join(helper, NULL);
+    mpz_clears(q, r, NULL);
+}
+
+static inline void* radix_decimal_job(void* arg) {
+    radix_job_t* job = (radix_job_t*)arg;
+    radix_decimal(job->out, *job->x, job->digits, job->threads);
+    return NULL;
+}
+
+// Bytes radix_convert may need for x >= 0 in format, terminator included
+static inline size_t radix_max_size(const mpz_t x, int format) {
+    if (format == RADIX_BINARY)
+        return (mpz_sizeinbase(x, 2) + 7) / 8 + 1;
+    return mpz_sizeinbase(x, format == RADIX_HEX ? 16 : 10) + 2;
+}
+
+// Write x >= 0 into out (radix_max_size bytes) using up to threads threads. Returns the
+// length; text formats are also NUL terminated.
+static inline size_t radix_convert(char* out, const mpz_t x, int format, int threads) {
+    if (format == RADIX_BINARY) {
+        size_t count = 0;
+        mpz_export(out, &count, 1, 1, 1, 0, x);
+        return count;
+    }
+    if (format == RADIX_HEX) {
+        mpz_get_str(out, 16, x);
+        return strlen(out);
+    }
+
+    // mpz_sizeinbase can be one too big; then the padding leaves a single leading zero
+    size_t digits = mpz_sizeinbase(x, 10);
+    radix_powers_for(digits);
+    radix_decimal(out, x, digits, threads < 1 ? 1 : threads);
+    if (digits > 1 && out[0] == '0') {
+        memmove(out, out + 1, digits - 1);
+        digits--;
+    }
+    out[digits] = '\0';
+    return digits;
+}
+
+// Exact number of decimal digits of x >= 0, without converting it
+static inline size_t radix_decimal_digits(const mpz_t x) {
+    size_t digits = mpz_sizeinbase(x, 10);
+    if (digits == 1)
+        return 1;
+    mpz_t power;
+    mpz_init(power);
+    mpz_ui_pow_ui(power, 10, digits - 1);
+    if (mpz_cmp(x, power) < 0)
+        digits--;
+    mpz_clear(power);
+    return digits;
+}
+
+// Convert x into one buffer and write it to file with a single fwrite
+static inline void radix_print(FILE* file, const mpz_t x, int format, int threads) {
+    char* out = (char*)malloc(radix_max_size(x, format));
+    if (out == NULL) {
+        perror("Failed to allocate conversion buffer");
+        return;
+    }
+    size_t length = radix_convert(out, x, format, threads);
+    fwrite(out, 1, length, file);
+    free(out);
+}
+
+// Convert x straight into an mmap'd file at path and make it durable.
+// Returns 0 on success, -1 (after perror) on failure.
+static inline int radix_write_file(const char* path, const mpz_t x, int format, int threads) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open output file");
+        return -1;
+    }
+    size_t size = radix_max_size(x, format);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        perror("Failed to size output file");
+        close(fd);
+        return -1;
+    }
+    char* out = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) {
+        perror("Failed to map output file");
+        close(fd);
+        return -1;
+    }
+    size_t length = radix_convert(out, x, format, threads);
+    int ok = msync(out, size, MS_SYNC) == 0;
+    munmap(out, size);
+    ok = ftruncate(fd, (off_t)length) == 0 && fsync(fd) == 0 && ok;
+    close(fd);
+    if (!ok) {
+        perror("Failed to write output file");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
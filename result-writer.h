@@ -0,0 +1,135 @@
+// Hands found results from the workers to a writer thread that does the slow part.
+//
+// Printing a Mersenne prime means converting millions of digits, and the cache file wants an
+// fsync; neither should run on a worker, and certainly not under a lock every other worker
+// needs. Workers push a small result_t onto a bounded lock-free ring (Vyukov's sequence
+// numbered cells, many producers, one consumer) and post a semaphore. The writer thread
+// waits on the semaphore, pops results in order and calls the program's write function.
+// A full ring makes the pushing worker yield until the writer catches up.
+
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#define RESULT_QUEUE_SIZE 256   // results that can wait for the writer, a power of two
+
+typedef struct {
+    unsigned long exponent;
+    int thread_id;              // worker that found it
+} result_t;
+
+typedef struct {
+    size_t sequence;            // position this cell is ready for: pos to fill, pos + 1 to read
+    result_t result;
+} result_cell_t;
+
+typedef struct result_writer {
+    result_cell_t* cells;
+    size_t head __attribute__((aligned(64)));   // next position to claim, shared by the workers
+    size_t tail __attribute__((aligned(64)));   // next position to read, writer thread only
+    sem_t ready;                // one post per pushed result, plus one to stop
+    int stopping;
+    void (*write)(const result_t*);
+    pthread_t thread;
+} result_writer_t;
+
+static inline void result_writer_init(result_writer_t* writer, void (*write)(const result_t*)) {
+    writer->cells = (result_cell_t*)malloc(RESULT_QUEUE_SIZE * sizeof(result_cell_t));
+    if (writer->cells == NULL) {
+        perror("Failed to allocate result queue");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < RESULT_QUEUE_SIZE; i++)
+        writer->cells[i].sequence = i;
+    writer->head = 0;
+    writer->tail = 0;
+    writer->stopping = 0;
+    writer->write = write;
+    sem_init(&writer->ready, 0, 0);
+}
+
+// Queue a result for the writer thread; never takes a lock
+static inline void result_writer_push(result_writer_t* writer, const result_t* result) {
+    size_t pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+    result_cell_t* cell;
+    for (;;) {
+        cell = &writer->cells[pos & (RESULT_QUEUE_SIZE - 1)];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t lag = (intptr_t)sequence - (intptr_t)pos;
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&writer->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else {
+            if (lag < 0)
+                sched_yield();  // full: the writer hasn't read this cell from the last lap
+            pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->result = *result;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&writer->ready);
+}
+
+static inline int result_writer_pop(result_writer_t* writer, result_t* result) {
+    result_cell_t* cell = &writer->cells[writer->tail & (RESULT_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != writer->tail + 1)
+        return 0;
+    *result = cell->result;
+    __atomic_store_n(&cell->sequence, writer->tail + RESULT_QUEUE_SIZE, __ATOMIC_RELEASE);
+    writer->tail++;
+    return 1;
+}
+
+static inline void* result_writer_thread(void* arg) {
+    result_writer_t* writer = (result_writer_t*)arg;
+    for (;;) {
+        if (sem_wait(&writer->ready) != 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        result_t result;
+        if (result_writer_pop(writer, &result)) {
+            writer->write(&result);
+        } else if (__atomic_load_n(&writer->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            // Another worker claimed the cell first and hasn't filled it yet
+            sched_yield();
+            sem_post(&writer->ready);
+        }
+    }
+    return NULL;
+}
+
+static inline void result_writer_start(result_writer_t* writer) {
+    if (pthread_create(&writer->thread, NULL, result_writer_thread, writer) != 0) {
+        perror("Failed to create result writer thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write everything still queued, then stop. Call once no worker can push any more.
+static inline void result_writer_stop(result_writer_t* writer) {
+    __atomic_store_n(&writer->stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&writer->ready);
+    pthread_join(writer->thread, NULL);
+    sem_destroy(&writer->ready);
+    free(writer->cells);
+}
+
+// Raise *best to value if value is larger, without a lock
+static inline void result_writer_max(unsigned long long* best, unsigned long long value) {
+    unsigned long long seen = __atomic_load_n(best, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(best, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+#endif
@@ -1,90 +1,78 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <gmp.h>
 
+#include "gmp-alloc.h"
+#include "prime-bitmap.h"
+
+// Atkin's quadratic forms, on the mod 30 bitmap of prime-bitmap.h. Numbers sharing a factor
+// with 30 have no bit, so their flips are skipped; 2, 3 and 5 are printed up front.
 void sieve_of_atkin(mpz_t limit) {
-    mpz_t x2, y2, n, limit_sqrt, remainder, temp, k;
-    mpz_init(x2);
-    mpz_init(y2);
-    mpz_init(n);
+    mpz_t limit_sqrt;
     mpz_init(limit_sqrt);
-    mpz_init(remainder);
-    mpz_init(temp);
-    mpz_init(k);
-
-    int limit_int = mpz_get_ui(limit);
-    char* sieve = calloc(limit_int + 1, sizeof(char));
-
     mpz_sqrt(limit_sqrt, limit);
-    for (mpz_set_ui(n, 1); mpz_cmp(n, limit_sqrt) <= 0; mpz_add_ui(n, n, 1)) {
-        mpz_mul(x2, n, n);
+    unsigned long top = mpz_get_ui(limit);
+    unsigned long root = mpz_get_ui(limit_sqrt);
+
+    prime_bitmap_init();
+    uint64_t bytes = prime_bitmap_bytes(top);
+    uint8_t* sieve = calloc(bytes, 1);
+    if (sieve == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
 
-        for (mpz_set_ui(y2, 1); mpz_cmp(y2, limit_sqrt) <= 0; mpz_add_ui(y2, y2, 1)) {
-            mpz_mul(y2, y2, y2);
+    for (unsigned long x = 1; x <= root; x++) {
+        unsigned long x2 = x * x;
+        for (unsigned long y = 1; y <= root; y++) {
+            unsigned long y2 = y * y;
 
-            mpz_set(temp, x2);
-            mpz_add(temp, temp, y2);
-            if (mpz_cmp(temp, limit) <= 0) {
-                mpz_mod_ui(remainder, temp, 12);
-                int r = mpz_get_ui(remainder);
-                if (r == 1 || r == 5) {
-                    sieve[mpz_get_ui(temp)] ^= 1;
-                }
+            unsigned long n = 4 * x2 + y2;
+            if (n <= top && (n % 12 == 1 || n % 12 == 5) && prime_bitmap_holds(n)) {
+                prime_bitmap_flip(sieve, n);
             }
 
-            mpz_set(temp, x2);
-            mpz_mul_ui(temp, temp, 3);
-            mpz_sub(temp, temp, y2);
-            if (mpz_cmp_ui(temp, 0) > 0 && mpz_cmp(temp, limit) <= 0) {
-                mpz_mod_ui(remainder, temp, 12);
-                int r = mpz_get_ui(remainder);
-                if (r == 7) {
-                    sieve[mpz_get_ui(temp)] ^= 1;
-                }
+            n = 3 * x2 + y2;
+            if (n <= top && n % 12 == 7 && prime_bitmap_holds(n)) {
+                prime_bitmap_flip(sieve, n);
             }
 
-            mpz_set(temp, x2);
-            mpz_mul_ui(temp, temp, 3);
-            mpz_add(temp, temp, y2);
-            if (mpz_cmp(temp, limit) <= 0) {
-                mpz_mod_ui(remainder, temp, 12);
-                int r = mpz_get_ui(remainder);
-                if (r == 11) {
-                    sieve[mpz_get_ui(temp)] ^= 1;
-                }
+            n = 3 * x2 - y2;
+            if (x > y && n <= top && n % 12 == 11 && prime_bitmap_holds(n)) {
+                prime_bitmap_flip(sieve, n);
             }
         }
     }
 
-    for (mpz_set_ui(n, 5); mpz_cmp(n, limit_sqrt) <= 0; mpz_add_ui(n, n, 1)) {
-        if (sieve[mpz_get_ui(n)]) {
-            mpz_mul(temp, n, n);
-            for (mpz_set(k, temp); mpz_cmp(k, limit) <= 0; mpz_add(k, k, temp)) {
-                sieve[mpz_get_ui(k)] = 0;
+    // What is left with an odd number of solutions is prime or has a square factor
+    for (unsigned long r = 7; r <= root; r++) {
+        if (prime_bitmap_holds(r) && prime_bitmap_test(sieve, r)) {
+            unsigned long square = r * r;
+            for (unsigned long k = square; k <= top; k += square) {
+                if (prime_bitmap_holds(k)) prime_bitmap_clear(sieve, k);
             }
         }
     }
 
-    if (limit_int >= 2) printf("2 ");
-    if (limit_int >= 3) printf("3 ");
-    for (mpz_set_ui(n, 5); mpz_cmp(n, limit) <= 0; mpz_add_ui(n, n, 1)) {
-        if (sieve[mpz_get_ui(n)]) {
-            gmp_printf("%Zd ", n);
+    if (top >= 2) printf("2 ");
+    if (top >= 3) printf("3 ");
+    if (top >= 5) printf("5 ");
+    for (uint64_t i = 0; i < bytes; i++) {
+        for (unsigned int bits = sieve[i]; bits; bits &= bits - 1) {
+            uint64_t n = prime_bitmap_number(i, __builtin_ctz(bits));
+            if (n > top) break;
+            printf("%lu ", (unsigned long)n);
         }
     }
     printf("\n");
 
-    mpz_clear(x2);
-    mpz_clear(y2);
-    mpz_clear(n);
     mpz_clear(limit_sqrt);
-    mpz_clear(remainder);
-    mpz_clear(temp);
-    mpz_clear(k);
     free(sieve);
 }
 
 int main(int argc, char* argv[]) {
+    gmp_alloc_install();
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <limit>\n", argv[0]);
         return 1;
@@ -5,110 +5,464 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
+
+#include "prime-bitmap.h"
 
 #define ANSI_COLOR_CYAN "\x1b[36m"
 #define ANSI_COLOR_YELLOW "\x1b[33m"
 #define ANSI_COLOR_GREEN "\x1b[32m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
-#define NUM_THREADS 4
+// The range is sieved one window at a time, on the mod 30 wheel of prime-bitmap.h, so the
+// crossing off stays in cache and memory is the window plus the primes up to sqrt(limit),
+// however big limit gets.
+#define SEGMENT_SIZE (32 * 1024) // bytes per window, 30 numbers each: sized for L1
+#define BLOCK_SEGMENTS 32        // windows per block at least; a block goes to one thread
+#define BLOCK_ROOTS 8            // and at least this many times sqrt(limit) numbers
+
+// Primes from here up step over more than half a window between multiples, so most windows
+// see at most one of them. They go in buckets instead of being looked at for every window.
+#define BUCKET_PRIME_MIN (PRIME_BITMAP_SPAN * SEGMENT_SIZE / 2)
+#define BUCKET_CHUNK_ENTRIES 1023    // multiples per bucket chunk, the chunk is 8 KB
+#define BUCKET_SLAB_CHUNKS 64        // chunks the pool allocates at once
+
+// Windows are grouped in blocks and the threads take whole blocks off a shared counter. Each
+// thread has its own window and its own next-multiple offsets, worked out once per block, so
+// no two threads ever write the same memory. Listed primes are formatted by the thread that
+// found them and written out block by block in order, so the output is the serial one.
+//
+// Large primes (Oliveira e Silva's bucket sieve): at the start of a block each one's first
+// multiple in it is dropped in the bucket of the window it falls in. Sieving a window empties
+// its bucket, and every multiple crossed off moves its prime on to the bucket of the window
+// its next multiple hits, or out of the block. A window never looks at a large prime that
+// doesn't hit it. Bucket chunks come from a per-thread pool and go back to it once read.
 
 typedef struct {
-    unsigned long long start;
-    unsigned long long end;
-    bool *sieve;
-    unsigned long long limit;
-} ThreadData;
+    uint32_t prime;
+    uint32_t position;           // byte in the window * 8 + wheel position of the multiple
+} BucketEntry;
 
-unsigned long long primes_found = 0;
-pthread_mutex_t primes_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct BucketChunk {
+    struct BucketChunk *next;
+    uint32_t count;
+    BucketEntry entries[BUCKET_CHUNK_ENTRIES];
+} BucketChunk;
 
-void *sieve_thread(void *arg) {
-    ThreadData *data = (ThreadData *)arg;
-    unsigned long long i, j;
+typedef struct {
+    BucketChunk *free;           // chunks ready for reuse
+    BucketChunk **slabs;         // everything allocated, to free at the end
+    size_t slab_count;
+    size_t slab_capacity;
+} BucketPool;
+
+typedef struct {
+    unsigned long long *primes;  // primes from 7 up to sqrt(limit)
+    size_t count;
+} BasePrimes;
+
+typedef struct {
+    pthread_t thread;
+    uint8_t *segment;
+    uint64_t *next;              // per base prime: byte of its next multiple, from the window start
+    uint8_t *wheel;              // and that multiple's wheel position
+    BucketChunk **buckets;       // per window of the block: large prime multiples that land in it
+    BucketPool pool;
+    char *text;                  // this block's primes, formatted
+    size_t text_length;
+    size_t text_capacity;
+    unsigned long long found;
+} Worker;
+
+BasePrimes base;
+unsigned long long limit;
+unsigned long long end;          // bitmap bytes up to limit
+unsigned long long block_span;   // bytes per block
+unsigned long long block_count;
+unsigned long long next_block = 0;
+bool print_primes = true;
+bool presieve = true;            // pre-sieve, unrolled kernels and buckets; off for the plain loop
+size_t presieved = 0;            // base primes the pre-sieve patterns already cover
+size_t bucketed;                 // base primes from here on go in buckets
+
+unsigned long long printed = 0;  // primes written so far, for the line breaks
+unsigned long long print_turn = 0;  // block whose text goes out next
+pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t print_cond = PTHREAD_COND_INITIALIZER;
 
-    for (i = data->start; i <= data->end && i * i <= data->limit; i++) {
-        if (!data->sieve[i]) {
-            for (j = i * i; j <= data->limit; j += i) {
-                data->sieve[j] = true;
+// floor(sqrt(n)), exact for every 64 bit n
+unsigned long long isqrt(unsigned long long n) {
+    unsigned long long r = (unsigned long long)sqrtl((long double)n);
+    while (r * r > n) r--;
+    while ((r + 1) * (r + 1) <= n) r++;
+    return r;
+}
+
+// Plain sieve up to sqrt(limit) for the primes that cross off the windows; 2, 3 and 5 are
+// the wheel's own
+void base_primes_init(BasePrimes *base, unsigned long long limit) {
+    unsigned long long root = isqrt(limit);
+    bool *composite = calloc(root + 1, sizeof(bool));
+    base->primes = malloc((root / 2 + 1) * sizeof(unsigned long long));
+    if (!composite || !base->primes) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    base->count = 0;
+    for (unsigned long long i = 3; i <= root; i += 2) {
+        if (composite[i]) continue;
+        for (unsigned long long j = i * i; j <= root; j += 2 * i) {
+            composite[j] = true;
+        }
+        if (i > 5) base->primes[base->count++] = i;
+    }
+    free(composite);
+
+    presieved = 0;
+    while (presieved < base->count && base->primes[presieved] <= PRIME_BITMAP_PRESIEVE_MAX) presieved++;
+    bucketed = presieved;
+    while (bucketed < base->count && base->primes[bucketed] < BUCKET_PRIME_MIN) bucketed++;
+}
+
+BucketChunk *bucket_pool_get(BucketPool *pool) {
+    if (!pool->free) {
+        BucketChunk *slab = malloc(BUCKET_SLAB_CHUNKS * sizeof(BucketChunk));
+        if (pool->slab_count == pool->slab_capacity) {
+            pool->slab_capacity = pool->slab_capacity ? 2 * pool->slab_capacity : 16;
+            pool->slabs = realloc(pool->slabs, pool->slab_capacity * sizeof(BucketChunk *));
+        }
+        if (!slab || !pool->slabs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        pool->slabs[pool->slab_count++] = slab;
+        for (int i = 0; i < BUCKET_SLAB_CHUNKS; i++) {
+            slab[i].next = pool->free;
+            pool->free = &slab[i];
+        }
+    }
+    BucketChunk *chunk = pool->free;
+    pool->free = chunk->next;
+    return chunk;
+}
+
+void bucket_pool_put(BucketPool *pool, BucketChunk *chunk) {
+    chunk->next = pool->free;
+    pool->free = chunk;
+}
+
+void bucket_pool_free(BucketPool *pool) {
+    for (size_t i = 0; i < pool->slab_count; i++) free(pool->slabs[i]);
+    free(pool->slabs);
+}
+
+// File a multiple of prime at byte offset (from the block start) under its window
+void bucket_push(Worker *worker, uint64_t offset, uint32_t prime, uint8_t wheel) {
+    BucketChunk **bucket = &worker->buckets[offset / SEGMENT_SIZE];
+    if (!*bucket || (*bucket)->count == BUCKET_CHUNK_ENTRIES) {
+        BucketChunk *chunk = bucket_pool_get(&worker->pool);
+        chunk->next = *bucket;
+        chunk->count = 0;
+        *bucket = chunk;
+    }
+    BucketEntry *entry = &(*bucket)->entries[(*bucket)->count++];
+    entry->prime = prime;
+    entry->position = (uint32_t)(offset % SEGMENT_SIZE) * 8 + wheel;
+}
+
+// Cross off every large prime multiple in window (a window index in the block starting at
+// byte low) and file each prime under the next window it hits
+void bucket_sieve(Worker *worker, unsigned long long low, unsigned long long high, size_t window, size_t length) {
+    BucketChunk *chunk = worker->buckets[window];
+    worker->buckets[window] = NULL;
+    uint64_t window_end = (uint64_t)window * SEGMENT_SIZE + length;
+    while (chunk) {
+        for (uint32_t i = 0; i < chunk->count; i++) {
+            BucketEntry entry = chunk->entries[i];
+            uint64_t next = entry.position / 8;
+            uint8_t wheel = entry.position % 8;
+            prime_bitmap_cross_off(worker->segment, length, entry.prime, &next, &wheel);
+            if (low + window_end + next < high) {
+                bucket_push(worker, window_end + next, entry.prime, wheel);
             }
         }
+        BucketChunk *used = chunk;
+        chunk = chunk->next;
+        bucket_pool_put(&worker->pool, used);
     }
+}
 
-    return NULL;
+// Point every base prime whose square comes before byte high at its first multiple from
+// byte low on. Returns how many primes that is.
+size_t block_start(Worker *worker, unsigned long long low, unsigned long long high) {
+    size_t small = presieve ? bucketed : base.count;
+    size_t k;
+    for (k = 0; k < small; k++) {
+        unsigned long long p = base.primes[k];
+        if ((p * p) / PRIME_BITMAP_SPAN >= high) return k;
+        worker->next[k] = prime_bitmap_start(p, low, &worker->wheel[k]) - low;
+    }
+    for (; k < base.count; k++) {
+        unsigned long long p = base.primes[k];
+        if ((p * p) / PRIME_BITMAP_SPAN >= high) break;
+        uint8_t wheel;
+        uint64_t start = prime_bitmap_start(p, low, &wheel);
+        if (start < high) {
+            bucket_push(worker, start - low, (uint32_t)p, wheel);
+        }
+    }
+    return small;
 }
 
-void count_primes(bool *sieve, unsigned long long limit) {
-    unsigned long long i;
-    unsigned long long count = 0;
+// Cross off the window of bytes [low, low + length); next[] is relative to low on the way in
+// and to low + length on the way out
+void sieve_segment(Worker *worker, unsigned long long low, size_t length, size_t active) {
+    uint8_t *segment = worker->segment;
+    size_t k = 0;
+    if (presieve) {
+        prime_bitmap_presieve(segment, length, low);
+        k = presieved < active ? presieved : active;
+    } else {
+        prime_bitmap_fill(segment, length);
+    }
+    for (; k < active; k++) {
+        if (worker->next[k] >= length) {
+            worker->next[k] -= length;  // a big prime that skips this window
+            continue;
+        }
+        if (presieve) {
+            prime_bitmap_cross_off_unrolled(segment, length, base.primes[k], &worker->next[k], &worker->wheel[k]);
+        } else {
+            prime_bitmap_cross_off(segment, length, base.primes[k], &worker->next[k], &worker->wheel[k]);
+        }
+    }
+    if (low == 0) {
+        segment[0] &= 0xfe;  // 1 is not prime
+    }
+    if (low + length == end) {
+        prime_bitmap_trim(&segment[length - 1], end - 1, limit);
+    }
+}
 
-    for (i = 2; i <= limit; i++) {
-        if (!sieve[i]) {
-            count++;
+void append_prime(Worker *worker, unsigned long long prime) {
+    if (worker->text_length + 24 > worker->text_capacity) {
+        worker->text_capacity = worker->text_capacity ? 2 * worker->text_capacity : 1 << 16;
+        worker->text = realloc(worker->text, worker->text_capacity);
+        if (!worker->text) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
     }
+    char digits[24];
+    int length = 0;
+    do {
+        digits[length++] = (char)('0' + prime % 10);
+        prime /= 10;
+    } while (prime);
+    while (length) worker->text[worker->text_length++] = digits[--length];
+    worker->text[worker->text_length++] = ' ';
+}
 
-    pthread_mutex_lock(&primes_mutex);
-    primes_found = count;
-    pthread_mutex_unlock(&primes_mutex);
+// Count (and format) the primes left in a window
+void count_primes(Worker *worker, unsigned long long low, size_t length) {
+    const uint8_t *segment = worker->segment;
+    if (!print_primes) {
+        worker->found += prime_bitmap_count(segment, length);
+        return;
+    }
+    for (size_t j = 0; j < length; j++) {
+        for (unsigned int bits = segment[j]; bits; bits &= bits - 1) {
+            worker->found++;
+            append_prime(worker, prime_bitmap_number(low + j, __builtin_ctz(bits)));
+        }
+    }
 }
 
-int main() {
-    unsigned long long limit;
-    printf("Enter the upper limit for prime number search: ");
-    scanf("%llu", &limit);
+// Wait for block's turn and write its text, breaking lines every 10 primes as the serial
+// sieve did
+void print_block(Worker *worker, unsigned long long block) {
+    pthread_mutex_lock(&print_mutex);
+    while (print_turn != block) pthread_cond_wait(&print_cond, &print_mutex);
 
-    bool *sieve = calloc(limit + 1, sizeof(bool));
-    if (!sieve) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return 1;
+    const char *text = worker->text;
+    size_t from = 0;
+    for (size_t i = 0; i < worker->text_length; i++) {
+        if (text[i] == ' ' && ++printed % 10 == 0) {
+            fwrite(text + from, 1, i + 1 - from, stdout);
+            fputc('\n', stdout);
+            from = i + 1;
+        }
     }
+    fwrite(text + from, 1, worker->text_length - from, stdout);
+    worker->text_length = 0;
 
-    sieve[0] = sieve[1] = true;
+    print_turn++;
+    pthread_cond_broadcast(&print_cond);
+    pthread_mutex_unlock(&print_mutex);
+}
+
+void *sieve_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    for (;;) {
+        unsigned long long block = __atomic_fetch_add(&next_block, 1, __ATOMIC_RELAXED);
+        if (block >= block_count) break;
 
-    pthread_t threads[NUM_THREADS];
-    ThreadData thread_data[NUM_THREADS];
+        unsigned long long low = block * block_span;
+        unsigned long long high = low + block_span < end ? low + block_span : end;
+        size_t active = block_start(worker, low, high);
+        for (unsigned long long window = low; window < high; window += SEGMENT_SIZE) {
+            size_t length = high - window < SEGMENT_SIZE ? high - window : SEGMENT_SIZE;
+            sieve_segment(worker, window, length, active);
+            bucket_sieve(worker, low, high, (window - low) / SEGMENT_SIZE, length);
+            count_primes(worker, window, length);
+        }
+        if (print_primes) print_block(worker, block);
+    }
+    return NULL;
+}
 
-    unsigned long long chunk_size = (limit - 1) / NUM_THREADS;
-    clock_t start_time = clock();
-    time_t last_update = time(NULL);
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    for (int i = 0; i < NUM_THREADS; i++) {
-        thread_data[i].start = 2 + i * chunk_size;
-        thread_data[i].end = (i == NUM_THREADS - 1) ? limit : (i + 1) * chunk_size + 1;
-        thread_data[i].sieve = sieve;
-        thread_data[i].limit = limit;
+// Sieve every block with num_threads threads; returns the primes found past 5
+unsigned long long run_sieve(int num_threads) {
+    unsigned long long primes_found = 0;
+    next_block = 0;
+    print_turn = 0;
 
-        if (pthread_create(&threads[i], NULL, sieve_thread, &thread_data[i]) != 0) {
+    Worker *workers = calloc(num_threads, sizeof(Worker));
+    if (!workers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].segment = malloc(SEGMENT_SIZE);
+        workers[i].next = malloc((base.count + 1) * sizeof(uint64_t));
+        workers[i].wheel = malloc(base.count + 1);
+        workers[i].buckets = calloc(block_span / SEGMENT_SIZE, sizeof(BucketChunk *));
+        if (!workers[i].segment || !workers[i].next || !workers[i].wheel || !workers[i].buckets) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        if (pthread_create(&workers[i].thread, NULL, sieve_thread, &workers[i]) != 0) {
             fprintf(stderr, "Failed to create thread %d\n", i);
-            free(sieve);
-            return 1;
+            exit(1);
         }
     }
 
-    for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        primes_found += workers[i].found;
+        free(workers[i].segment);
+        free(workers[i].next);
+        free(workers[i].wheel);
+        free(workers[i].buckets);
+        bucket_pool_free(&workers[i].pool);
+        free(workers[i].text);
     }
+    free(workers);
+    return primes_found;
+}
+
+// -b: count the primes with the plain crossing off loop and again with the pre-sieve, the
+// unrolled kernels and the buckets, and compare
+void benchmark(int num_threads) {
+    print_primes = false;
+    const char *kernels = prime_bitmap_tables.use_avx512 ? "AVX-512" : prime_bitmap_tables.use_avx2 ? "AVX2" : "scalar";
 
-    count_primes(sieve, limit);
+    presieve = false;
+    double start = now_seconds();
+    unsigned long long plain_count = run_sieve(num_threads);
+    double plain_time = now_seconds() - start;
 
-    clock_t end_time = clock();
-    double cpu_time_used = ((double) (end_time - start_time)) / CLOCKS_PER_SEC;
+    presieve = true;
+    start = now_seconds();
+    unsigned long long fast_count = run_sieve(num_threads);
+    double fast_time = now_seconds() - start;
+
+    printf("\n" ANSI_COLOR_CYAN "Plain loop:         %.3f seconds" ANSI_COLOR_RESET "\n", plain_time);
+    printf(ANSI_COLOR_CYAN "Pre-sieve (%s): %.3f seconds" ANSI_COLOR_RESET "\n", kernels, fast_time);
+    printf(ANSI_COLOR_GREEN "Speedup: %.2fx" ANSI_COLOR_RESET "\n", plain_time / fast_time);
+    if (plain_count != fast_count) {
+        printf(ANSI_COLOR_YELLOW "Counts differ: %llu vs %llu" ANSI_COLOR_RESET "\n", plain_count, fast_count);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool bench = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "qt:b")) != -1) {
+        switch (opt) {
+            case 'q':
+                print_primes = false;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'b':
+                bench = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-q] [-t <threads>] [-b]\n  -q  count the primes without listing them\n"
+                                "  -t  threads to sieve with, all online CPUs by default\n"
+                                "  -b  time the pre-sieve against the plain crossing off loop\n", argv[0]);
+                return 1;
+        }
+    }
+    if (num_threads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return 1;
+    }
+
+    printf("Enter the upper limit for prime number search: ");
+    if (scanf("%llu", &limit) != 1) {
+        fprintf(stderr, "Invalid limit\n");
+        return 1;
+    }
+
+    double start_time = now_seconds();
+    prime_bitmap_init();
+    base_primes_init(&base, limit);
+
+    // A block spans several sqrt(limit) numbers so working out its start offsets (and
+    // filling the buckets) stays cheap next to sieving it
+    end = limit >= 7 ? prime_bitmap_bytes(limit) : 0;
+    unsigned long long segments = BLOCK_ROOTS * isqrt(limit) / (PRIME_BITMAP_SPAN * SEGMENT_SIZE) + 1;
+    block_span = (unsigned long long)SEGMENT_SIZE * (segments > BLOCK_SEGMENTS ? segments : BLOCK_SEGMENTS);
+    block_count = (end + block_span - 1) / block_span;
+    if ((unsigned long long)num_threads > block_count) num_threads = block_count ? (int)block_count : 1;
+
+    if (bench) {
+        benchmark(num_threads);
+        free(base.primes);
+        return 0;
+    }
 
     printf("\n" ANSI_COLOR_CYAN "Prime numbers up to %llu:" ANSI_COLOR_RESET "\n", limit);
-    unsigned long long printed = 0;
-    for (unsigned long long i = 2; i <= limit; i++) {
-        if (!sieve[i]) {
-            printf("%llu ", i);
+    unsigned long long primes_found = 0;
+    const unsigned long long wheel_primes[] = { 2, 3, 5 };
+    for (int i = 0; i < 3 && wheel_primes[i] <= limit; i++) {
+        primes_found++;
+        if (print_primes) {
+            printf("%llu ", wheel_primes[i]);
             printed++;
-            if (printed % 10 == 0) printf("\n");
         }
     }
 
+    primes_found += run_sieve(num_threads);
+
+    double time_used = now_seconds() - start_time;
+
     printf("\n\n" ANSI_COLOR_YELLOW "Total prime numbers found: %llu" ANSI_COLOR_RESET "\n", primes_found);
-    printf(ANSI_COLOR_GREEN "Time taken: %.2f seconds (mostly acurate most of the time except when it is not)" ANSI_COLOR_RESET "\n", cpu_time_used);
-    printf(ANSI_COLOR_CYAN "Primes per second: %.2f" ANSI_COLOR_RESET "\n", primes_found / cpu_time_used);
+    printf(ANSI_COLOR_GREEN "Time taken: %.2f seconds (mostly acurate most of the time except when it is not)" ANSI_COLOR_RESET "\n", time_used);
+    printf(ANSI_COLOR_CYAN "Primes per second: %.2f" ANSI_COLOR_RESET "\n", primes_found / time_used);
 
-    free(sieve);
+    free(base.primes);
     return 0;
 }
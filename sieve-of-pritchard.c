@@ -2,6 +2,8 @@
 #include <gmp.h>
 #include <stdlib.h>
 
+#include "gmp-alloc.h"
+
 void sieve_of_pritchard(mpz_t limit) {
     mpz_t n, m, a, b, c, i, j, p, q, x, y, z;
     mpz_inits(n, m, a, b, c, i, j, p, q, x, y, z, NULL);
@@ -42,6 +44,7 @@ void sieve_of_pritchard(mpz_t limit) {
 }
 
 int main(int argc, char *argv[]) {
+    gmp_alloc_install();
     if (argc != 2) {
         printf("Usage: %s <limit>\n", argv[0]);
         return 1;
@@ -2,28 +2,47 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <gmp.h>
 
-void sieve_of_sundaram(int n, int *marked) {
-    int half = (n - 1) / 2;
-    for (int i = 1; i <= half; ++i) {
-        for (int j = i; (i + j + 2 * i * j) <= half; ++j) {
-            marked[i + j + 2 * i * j] = 1;
+#include "gmp-alloc.h"
+#include "prime-bitmap.h"
+
+// i + j + 2ij marks the odd composite 2(i + j + 2ij) + 1. The candidates live on the mod 30
+// bitmap of prime-bitmap.h, so odd multiples of 3 and 5 have no bit to clear.
+void sieve_of_sundaram(uint64_t n, uint8_t *candidates) {
+    uint64_t half = (n - 1) / 2;
+    for (uint64_t i = 1; i + i + 2 * i * i <= half; ++i) {
+        for (uint64_t j = i; (i + j + 2 * i * j) <= half; ++j) {
+            uint64_t composite = 2 * (i + j + 2 * i * j) + 1;
+            if (prime_bitmap_holds(composite)) {
+                prime_bitmap_clear(candidates, composite);
+            }
         }
     }
 }
 
-void print_primes(int n, int *marked) {
+void print_primes(uint64_t n, uint8_t *candidates) {
     mpz_t prime;
     mpz_init(prime);
 
     if (n > 2) {
         printf("2\n");
     }
+    if (n >= 3) {
+        printf("3\n");
+    }
+    if (n >= 5) {
+        printf("5\n");
+    }
 
-    for (int i = 1; i <= (n - 1) / 2; ++i) {
-        if (!marked[i]) {
-            mpz_set_ui(prime, 2 * i + 1);
+    uint64_t bytes = prime_bitmap_bytes(n);
+    for (uint64_t i = 0; i < bytes; ++i) {
+        for (unsigned int bits = candidates[i]; bits; bits &= bits - 1) {
+            uint64_t number = prime_bitmap_number(i, __builtin_ctz(bits));
+            if (number == 1) continue;
+            if (number > n) break;
+            mpz_set_ui(prime, number);
             gmp_printf("%Zd\n", prime);
         }
     }
@@ -32,26 +51,31 @@ void print_primes(int n, int *marked) {
 }
 
 int main(int argc, char *argv[]) {
+    gmp_alloc_install();
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <upper_bound>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    int n = atoi(argv[1]);
-    if (n < 2) {
+    char *end;
+    uint64_t n = strtoull(argv[1], &end, 10);
+    if (*end != '\0' || argv[1][0] == '-' || n < 2) {
         fprintf(stderr, "Upper bound must be at least 2\n");
         return EXIT_FAILURE;
     }
 
-    int *marked = calloc((n - 1) / 2 + 1, sizeof(int));
-    if (marked == NULL) {
+    prime_bitmap_init();
+    uint64_t bytes = prime_bitmap_bytes(n);
+    uint8_t *candidates = malloc(bytes);
+    if (candidates == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         return EXIT_FAILURE;
     }
+    prime_bitmap_fill(candidates, bytes);
 
-    sieve_of_sundaram(n, marked);
-    print_primes(n, marked);
+    sieve_of_sundaram(n, candidates);
+    print_primes(n, candidates);
 
-    free(marked);
+    free(candidates);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,226 @@
+// CPU topology from sysfs, for placing the "super core" threads of mersenne-intel.c.
+//
+// Every usable CPU is read from <root>/cpuN: its physical core (first CPU of core_cpus_list),
+// its last level cache (first CPU of shared_cpu_list of the highest cache index), and its NUMA
+// node (the nodeM entry). CPUs sharing an LLC form a domain, which gets one controller thread.
+// Inside a domain, workers go one per physical core first, so two of them never share the FP
+// units of one core; SMT siblings are only used when asked for.
+//
+// Anything sysfs does not say is filled in conservatively: a CPU without core info is its own
+// core, without cache info it shares its package, without a node it is on node 0.
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+
+#define TOPOLOGY_SYSFS "/sys/devices/system/cpu"
+
+typedef struct {
+    int cpu;
+    int core;       // first CPU of its physical core
+    int llc;        // first CPU sharing its last level cache
+    int node;       // NUMA node
+    int smt;        // 0 for the first thread of the core, 1 for the next sibling, ...
+} topology_cpu_t;
+
+typedef struct {
+    int node;
+    int llc;
+    int* cpus;      // worker CPUs: one per core first, then siblings if SMT is used
+    int workers;    // how many of cpus get a worker
+    int cores;
+    int first_worker;   // global id of the first worker in this domain
+} topology_domain_t;
+
+typedef struct {
+    topology_cpu_t* cpus;
+    int cpu_count;
+    topology_domain_t* domains;
+    int domain_count;
+    int core_count;
+    int node_count;
+    int workers;    // sum over the domains
+} topology_t;
+
+static inline int topology_read_text(const char* path, char* text, size_t size) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    int ok = fgets(text, (int)size, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+// First CPU in a list like "0-3,8-11", or -1
+static inline int topology_read_first(const char* path) {
+    char text[4096];
+    int cpu;
+    if (!topology_read_text(path, text, sizeof(text)) || sscanf(text, "%d", &cpu) != 1)
+        return -1;
+    return cpu;
+}
+
+static inline int topology_compare_cpu(const void* a, const void* b) {
+    const topology_cpu_t* x = (const topology_cpu_t*)a;
+    const topology_cpu_t* y = (const topology_cpu_t*)b;
+    if (x->llc != y->llc)
+        return x->llc - y->llc;
+    if (x->smt != y->smt)
+        return x->smt - y->smt;
+    return x->cpu - y->cpu;
+}
+
+static inline void topology_read_cpu(const char* root, topology_cpu_t* info) {
+    char path[512];
+    int cpu = info->cpu;
+
+    snprintf(path, sizeof(path), "%s/cpu%d/topology/core_cpus_list", root, cpu);
+    info->core = topology_read_first(path);
+    if (info->core < 0) {
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/thread_siblings_list", root, cpu);
+        info->core = topology_read_first(path);
+    }
+    if (info->core < 0)
+        info->core = cpu;
+
+    // The highest level cache is the last level cache
+    int best_level = 0;
+    info->llc = -1;
+    for (int index = 0; index < 16; index++) {
+        char text[64];
+        int level;
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level", root, cpu, index);
+        if (!topology_read_text(path, text, sizeof(text)) || sscanf(text, "%d", &level) != 1)
+            break;
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/type", root, cpu, index);
+        if (topology_read_text(path, text, sizeof(text)) && strncmp(text, "Instruction", 11) == 0)
+            continue;
+        if (level > best_level) {
+            snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/shared_cpu_list", root, cpu, index);
+            int first = topology_read_first(path);
+            if (first >= 0) {
+                best_level = level;
+                info->llc = first;
+            }
+        }
+    }
+    if (info->llc < 0) {
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/package_cpus_list", root, cpu);
+        info->llc = topology_read_first(path);
+    }
+    if (info->llc < 0) {
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/core_siblings_list", root, cpu);
+        info->llc = topology_read_first(path);
+    }
+    if (info->llc < 0)
+        info->llc = 0;
+
+    info->node = 0;
+    snprintf(path, sizeof(path), "%s/cpu%d", root, cpu);
+    DIR* dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) == 1)
+                info->node = node;
+        }
+        closedir(dir);
+    }
+}
+
+// Read the topology under root (TOPOLOGY_SYSFS normally) for the CPUs in allowed (NULL for
+// every online CPU) and lay out the workers, with SMT siblings only when use_smt is set.
+// Returns 0 if no CPU could be found.
+static inline int topology_load(topology_t* topology, const char* root, const cpu_set_t* allowed, int use_smt) {
+    memset(topology, 0, sizeof(*topology));
+    DIR* dir = opendir(root);
+    if (dir == NULL)
+        return 0;
+
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int cpu;
+        char rest;
+        if (sscanf(entry->d_name, "cpu%d%c", &cpu, &rest) != 1)
+            continue;
+        if (allowed != NULL && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)))
+            continue;
+        char path[512], text[16];
+        snprintf(path, sizeof(path), "%s/cpu%d/online", root, cpu);
+        if (topology_read_text(path, text, sizeof(text)) && text[0] == '0')
+            continue;
+
+        if (topology->cpu_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            topology->cpus = (topology_cpu_t*)realloc(topology->cpus, capacity * sizeof(topology_cpu_t));
+        }
+        topology_cpu_t* info = &topology->cpus[topology->cpu_count++];
+        memset(info, 0, sizeof(*info));
+        info->cpu = cpu;
+        topology_read_cpu(root, info);
+    }
+    closedir(dir);
+    if (topology->cpu_count == 0)
+        return 0;
+
+    // SMT rank inside each core, counting only the CPUs we may use
+    for (int i = 0; i < topology->cpu_count; i++) {
+        topology_cpu_t* info = &topology->cpus[i];
+        for (int j = 0; j < topology->cpu_count; j++)
+            if (topology->cpus[j].core == info->core && topology->cpus[j].cpu < info->cpu)
+                info->smt++;
+        if (info->smt == 0)
+            topology->core_count++;
+        if (info->node + 1 > topology->node_count)
+            topology->node_count = info->node + 1;
+    }
+    qsort(topology->cpus, topology->cpu_count, sizeof(topology_cpu_t), topology_compare_cpu);
+
+    // One domain per LLC; sorting put each domain's CPUs together, cores before siblings
+    for (int i = 0; i < topology->cpu_count; ) {
+        int end = i;
+        while (end < topology->cpu_count && topology->cpus[end].llc == topology->cpus[i].llc)
+            end++;
+
+        topology->domains = (topology_domain_t*)realloc(topology->domains, (topology->domain_count + 1) * sizeof(topology_domain_t));
+        topology_domain_t* domain = &topology->domains[topology->domain_count++];
+        domain->node = topology->cpus[i].node;
+        domain->llc = topology->cpus[i].llc;
+        domain->cpus = (int*)malloc((end - i) * sizeof(int));
+        domain->cores = 0;
+        for (int j = i; j < end; j++) {
+            domain->cpus[j - i] = topology->cpus[j].cpu;
+            if (topology->cpus[j].smt == 0)
+                domain->cores++;
+        }
+        domain->workers = use_smt ? end - i : domain->cores;
+        domain->first_worker = topology->workers;
+        topology->workers += domain->workers;
+        i = end;
+    }
+    return 1;
+}
+
+static inline void topology_clear(topology_t* topology) {
+    for (int i = 0; i < topology->domain_count; i++)
+        free(topology->domains[i].cpus);
+    free(topology->domains);
+    free(topology->cpus);
+}
+
+// Every CPU of a domain, for pinning its controller
+static inline void topology_domain_cpuset(const topology_domain_t* domain, const topology_t* topology, cpu_set_t* set) {
+    CPU_ZERO(set);
+    for (int i = 0; i < topology->cpu_count; i++)
+        if (topology->cpus[i].llc == domain->llc && topology->cpus[i].cpu < CPU_SETSIZE)
+            CPU_SET(topology->cpus[i].cpu, set);
+}
+
+#endif
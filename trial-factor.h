@@ -0,0 +1,290 @@
+// Trial factoring pre-stage for 2^p - 1.
+//
+// Any factor q of 2^p - 1 (p an odd prime) has the form q = 2kp + 1 with q = +-1 (mod 8).
+// The k values are sieved against small primes so only prime-looking q are tried, and
+// each q is tested by computing 2^p mod q with Montgomery arithmetic: 64-bit for q < 2^64,
+// 128-bit (R = 2^128, products built from four 64x64 multiplies) from there up to
+// TF_MAX_BITS. 2^p - 1 itself never has to be built for an exponent that trial factoring
+// rules out.
+//
+// How deep to search is decided by trial_factor_bits(): a factor between 2^b and 2^(b+1)
+// turns up with probability about 1/b, so bit level b is worth searching while 1/b of the
+// full test's cost is more than the cost of trying every q in that level. The cost of a k
+// value on either path and of a squaring on the engine the full test will use are measured
+// on the host the first time they are needed.
+
+#ifndef TRIAL_FACTOR_H
+#define TRIAL_FACTOR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <gmp.h>
+
+#include "mersenne-mod.h"
+#include "ibdwt.h"
+
+#define TF_MAX_BITS 96           // deepest bit level searched; q up to here fits the 128-bit path
+#define TF_SIEVE_PRIMES 128      // small odd primes used to sieve the k values
+#define TF_BLOCK 4096            // k values sieved per block
+#define TF_CALIBRATION_K 200000  // k values timed when measuring trial factoring speed
+
+static const unsigned int tf_small_primes[TF_SIEVE_PRIMES] = {
+      3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,  59,
+     61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131, 137,
+    139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227,
+    229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311, 313,
+    317, 331, 337, 347, 349, 353, 359, 367, 373, 379, 383, 389, 397, 401, 409, 419,
+    421, 431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487, 491, 499, 503, 509,
+    521, 523, 541, 547, 557, 563, 569, 571, 577, 587, 593, 599, 601, 607, 613, 617,
+    619, 631, 641, 643, 647, 653, 659, 661, 673, 677, 683, 691, 701, 709, 719, 727
+};
+
+typedef unsigned __int128 tf_factor_t;
+
+static pthread_mutex_t tf_model_lock = PTHREAD_MUTEX_INITIALIZER;
+static double tf_ns_per_k[2];               // measured cost of one k value (sieve + powering), q below / above 2^64
+static double tf_square_ns[2][64];          // measured cost of one squaring mod 2^p - 1 on GMP / IBDWT, by log2(p)
+
+static inline double tf_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// a * b / 2^64 mod q, with qinv = -q^-1 mod 2^64
+static inline uint64_t tf_mont_mul(uint64_t a, uint64_t b, uint64_t q, uint64_t qinv) {
+    unsigned __int128 t = (unsigned __int128)a * b;
+    uint64_t m = (uint64_t)t * qinv;
+    unsigned __int128 mq = (unsigned __int128)m * q;
+    unsigned __int128 u = (unsigned __int128)(uint64_t)(t >> 64) + (uint64_t)(mq >> 64) + ((uint64_t)t != 0);
+    if (u >= q)
+        u -= q;
+    return (uint64_t)u;
+}
+
+// Returns 1 when q divides 2^p - 1, i.e. 2^p = 1 (mod q). q must be odd.
+static inline int tf_divides(unsigned long p, uint64_t q) {
+    uint64_t inv = q;
+    for (int i = 0; i < 5; i++)
+        inv *= 2 - q * inv;
+    uint64_t qinv = -inv;
+    uint64_t one = (-q) % q;   // 2^64 mod q, i.e. 1 in Montgomery form
+
+    int bit = 63 - __builtin_clzl(p);
+    uint64_t x = one + one;    // top bit of p is always set: start from 2
+    if (x >= q || x < one)
+        x -= q;
+
+    while (--bit >= 0) {
+        x = tf_mont_mul(x, x, q, qinv);
+        if ((p >> bit) & 1) {
+            uint64_t doubled = x + x;
+            if (doubled >= q || doubled < x)
+                doubled -= q;
+            x = doubled;
+        }
+    }
+
+    return x == one;
+}
+
+// Full 256-bit product of a and b as hi * 2^128 + lo
+static inline void tf_mul_wide(tf_factor_t a, tf_factor_t b, tf_factor_t* hi, tf_factor_t* lo) {
+    uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64);
+    uint64_t b0 = (uint64_t)b, b1 = (uint64_t)(b >> 64);
+    tf_factor_t p00 = (tf_factor_t)a0 * b0, p01 = (tf_factor_t)a0 * b1;
+    tf_factor_t p10 = (tf_factor_t)a1 * b0, p11 = (tf_factor_t)a1 * b1;
+    tf_factor_t mid = (p00 >> 64) + (uint64_t)p01 + (uint64_t)p10;
+    *lo = (mid << 64) | (uint64_t)p00;
+    *hi = p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+}
+
+// a * b / 2^128 mod q, with qinv = -q^-1 mod 2^128 and q < 2^127
+static inline tf_factor_t tf_mont_mul_wide(tf_factor_t a, tf_factor_t b, tf_factor_t q, tf_factor_t qinv) {
+    tf_factor_t t_hi, t_lo, mq_hi, mq_lo;
+    tf_mul_wide(a, b, &t_hi, &t_lo);
+    tf_mul_wide(t_lo * qinv, q, &mq_hi, &mq_lo);
+    // t_lo + mq_lo is 0 mod 2^128, with a carry unless both are 0
+    tf_factor_t u = t_hi + mq_hi + (t_lo != 0);
+    if (u >= q)
+        u -= q;
+    return u;
+}
+
+// tf_divides for 2^64 <= q < 2^127
+static inline int tf_divides_wide(unsigned long p, tf_factor_t q) {
+    tf_factor_t inv = q;
+    for (int i = 0; i < 6; i++)
+        inv *= 2 - q * inv;
+    tf_factor_t qinv = -inv;
+    tf_factor_t one = (-q) % q;   // 2^128 mod q
+
+    int bit = 63 - __builtin_clzl(p);
+    tf_factor_t x = one + one;
+    if (x >= q)
+        x -= q;
+
+    while (--bit >= 0) {
+        x = tf_mont_mul_wide(x, x, q, qinv);
+        if ((p >> bit) & 1) {
+            x += x;
+            if (x >= q)
+                x -= q;
+        }
+    }
+
+    return x == one;
+}
+
+// Try every q = 2kp + 1 with k_start <= k < k_end and q < 2^max_bits.
+// Returns 1 and stores the factor when one is found.
+static inline int tf_search(unsigned long p, uint64_t k_start, uint64_t k_end, unsigned int max_bits, tf_factor_t* factor) {
+    tf_factor_t q_limit = (tf_factor_t)1 << max_bits;
+    tf_factor_t k_limit = (q_limit - 1) / (2 * (tf_factor_t)p) + 1;
+    if (k_end > k_limit)
+        k_end = (uint64_t)k_limit;
+
+    unsigned char skip[TF_BLOCK];
+    uint64_t two_p = 2 * (uint64_t)p;
+
+    // q = 2kp + 1 = 0 (mod r)  <=>  k = -(2p)^-1 (mod r)
+    uint64_t bad_k[TF_SIEVE_PRIMES];
+    for (int i = 0; i < TF_SIEVE_PRIMES; i++) {
+        uint64_t r = tf_small_primes[i];
+        uint64_t step = two_p % r;
+        bad_k[i] = r;
+        if (step == 0)
+            continue;
+        uint64_t inv = 1;
+        while (inv * step % r != 1)
+            inv++;
+        bad_k[i] = r - inv;
+    }
+
+    for (uint64_t block = k_start; block < k_end; block += TF_BLOCK) {
+        uint64_t count = k_end - block < TF_BLOCK ? k_end - block : TF_BLOCK;
+        memset(skip, 0, count);
+
+        for (int i = 0; i < TF_SIEVE_PRIMES; i++) {
+            uint64_t r = tf_small_primes[i];
+            if (bad_k[i] == r)
+                continue;
+            uint64_t first = (bad_k[i] + r - block % r) % r;
+            for (uint64_t j = first; j < count; j += r) {
+                if ((tf_factor_t)(block + j) * two_p + 1 != r)
+                    skip[j] = 1;
+            }
+        }
+
+        for (uint64_t j = 0; j < count; j++) {
+            if (skip[j])
+                continue;
+            tf_factor_t q = (tf_factor_t)(block + j) * two_p + 1;
+            if ((q & 7) != 1 && (q & 7) != 7)
+                continue;
+            if (q >> 64 ? tf_divides_wide(p, q) : tf_divides(p, (uint64_t)q)) {
+                *factor = q;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Cost of one squaring mod 2^p - 1 at the size of p on the engine the full test will use,
+// measured once per power of two. The timing runs outside the lock, so other workers don't
+// wait on it; two of them may both time the same size the first time round.
+static inline double tf_square_cost_ns(unsigned long p, unsigned long fft_crossover) {
+    int level = 63 - __builtin_clzl(p);
+    int use_fft = p >= fft_crossover;
+
+    pthread_mutex_lock(&tf_model_lock);
+    double cost = tf_square_ns[use_fft][level];
+    pthread_mutex_unlock(&tf_model_lock);
+    if (cost != 0.0)
+        return cost;
+
+    unsigned long bits = 1UL << level;
+    special_mod_t mod;
+    special_mod_init(&mod, bits, 1);
+    mp_limb_t* s = special_mod_alloc(&mod);
+    memset(s, 0xa5, mod.n * sizeof(mp_limb_t));
+    s[mod.n - 1] >>= 1;
+
+    int reps = bits < 100000 ? 64 : 4;
+    double start;
+    if (use_fft) {
+        ibdwt_t t;
+        ibdwt_init(&t, bits, ibdwt_choose_length(bits));
+        ibdwt_set_limbs(&t, s, mod.n);
+        start = tf_now_ns();
+        for (int i = 0; i < reps; i++)
+            ibdwt_square(&t, 1, 0);
+        cost = (tf_now_ns() - start) / reps;
+        ibdwt_clear(&t);
+    } else {
+        start = tf_now_ns();
+        for (int i = 0; i < reps; i++)
+            special_mod_sqr(&mod, s, s);
+        cost = (tf_now_ns() - start) / reps;
+    }
+    free(s);
+    special_mod_clear(&mod);
+
+    pthread_mutex_lock(&tf_model_lock);
+    tf_square_ns[use_fft][level] = cost;
+    pthread_mutex_unlock(&tf_model_lock);
+    return cost;
+}
+
+// Cost of one k value with q below 2^64 (wide = 0) or above it (wide = 1)
+static inline double tf_k_cost_ns(int wide) {
+    pthread_mutex_lock(&tf_model_lock);
+    if (tf_ns_per_k[wide] == 0.0) {
+        tf_factor_t factor;
+        uint64_t k_start = wide ? (uint64_t)(((tf_factor_t)1 << 64) / (2 * 1000003UL)) + 1 : 1;
+        double start = tf_now_ns();
+        tf_search(1000003, k_start, k_start + TF_CALIBRATION_K, TF_MAX_BITS, &factor);
+        tf_ns_per_k[wide] = (tf_now_ns() - start) / TF_CALIBRATION_K;
+    }
+    double cost = tf_ns_per_k[wide];
+    pthread_mutex_unlock(&tf_model_lock);
+
+    return cost;
+}
+
+// Bit depth worth trial factoring 2^p - 1 to (search q < 2^bits); 0 means skip the stage.
+// The full test squares on the IBDWT from fft_crossover up.
+static inline unsigned int trial_factor_bits(unsigned long p, unsigned long fft_crossover) {
+    if (p < 8)
+        return 0;
+
+    // Factors above sqrt(2^p - 1) are never needed, and k = (q - 1) / 2p must fit in 64 bits
+    unsigned int max_bits = p / 2 < TF_MAX_BITS ? (unsigned int)(p / 2) : TF_MAX_BITS;
+    unsigned int k_bits = 64 + (64 - __builtin_clzl(p));
+    if (max_bits > k_bits)
+        max_bits = k_bits;
+    double full_test_ns = (double)p * tf_square_cost_ns(p, fft_crossover);
+
+    unsigned int bits = 64 - __builtin_clzl(2 * p + 1);
+    while (bits < max_bits) {
+        double level_ks = ldexp(1.0, bits) / (2.0 * p);
+        if (level_ks * tf_k_cost_ns(bits >= 64) > full_test_ns / bits)
+            break;
+        bits++;
+    }
+
+    return bits;
+}
+
+// Search all q = 2kp + 1 < 2^bits; returns 1 and stores the factor when one is found
+static inline int trial_factor(unsigned long p, unsigned int bits, tf_factor_t* factor) {
+    if (bits == 0 || p < 3)
+        return 0;
+    return tf_search(p, 1, UINT64_MAX, bits, factor);
+}
+
+#endif
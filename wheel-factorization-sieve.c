@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <gmp.h>
 
+#include "gmp-alloc.h"
+
 #define WHEEL_SIZE 48
 #define WHEEL_PRIMES 5
 
@@ -74,6 +76,7 @@ void find_primes(mpz_t limit) {
 }
 
 int main(int argc, char *argv[]) {
+    gmp_alloc_install();
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <upper_limit>\n", argv[0]);
         return 1;
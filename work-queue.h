@@ -0,0 +1,205 @@
+// Shared work queue for the Mersenne searchers.
+//
+// Every worker owns a Chase-Lev deque of exponents. It refills its deque with a batch from
+// the exponent stream when it runs dry, works through the batch smallest first, and once
+// the stream is used up it steals the largest exponents left in the other deques. Pushing,
+// popping and stealing are lock-free; only taking a fresh batch from the sieve goes
+// through the stream's lock, once per batch.
+//
+// A full test costs roughly p^2 log p, so batches shrink as p grows: thousands of cheap
+// small exponents per refill, down to one exponent at a time once a test takes seconds.
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "exponent-sieve.h"
+
+#define WORK_QUEUE_CAPACITY 1024        // slots per deque, a power of two
+#define WORK_QUEUE_MAX_BATCH 256        // never more than this many exponents per refill
+#define WORK_QUEUE_BATCH_COST 6.4e8     // p^2 log2 p summed over one batch
+
+typedef struct {
+    long top;                           // thieves take from here
+    long bottom;                        // the owner pushes and pops here
+    unsigned long current;              // exponent the owner is testing, 0 when idle
+    unsigned long items[WORK_QUEUE_CAPACITY];
+} __attribute__((aligned(64))) work_deque_t;
+
+typedef struct {
+    exponent_stream_t* stream;
+    work_deque_t* deques;
+    int count;
+} work_queue_t;
+
+static inline void work_queue_init(work_queue_t* queue, exponent_stream_t* stream, int count) {
+    void* deques = NULL;
+    if (posix_memalign(&deques, 64, count * sizeof(work_deque_t)) != 0) {
+        perror("Failed to allocate work queue");
+        exit(EXIT_FAILURE);
+    }
+    memset(deques, 0, count * sizeof(work_deque_t));
+    queue->stream = stream;
+    queue->deques = (work_deque_t*)deques;
+    queue->count = count;
+}
+
+static inline void work_queue_clear(work_queue_t* queue) {
+    free(queue->deques);
+}
+
+static inline void work_deque_push(work_deque_t* deque, unsigned long p) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->items[b & (WORK_QUEUE_CAPACITY - 1)], p, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// Owner side: newest exponent, or 0 when the deque is empty
+static inline unsigned long work_deque_pop(work_deque_t* deque) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    unsigned long p = 0;
+    if (t <= b) {
+        p = __atomic_load_n(&deque->items[b & (WORK_QUEUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+        if (t == b) {
+            // Last one: race the thieves for it
+            if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                p = 0;
+            __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+// Thief side: oldest exponent, or 0 when the deque is empty or another thief won
+static inline unsigned long work_deque_steal(work_deque_t* deque) {
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+
+    unsigned long p = __atomic_load_n(&deque->items[t & (WORK_QUEUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 0;
+    return p;
+}
+
+// Roughly where the stream is: its next exponent, read without the lock
+static inline unsigned long work_queue_stream_position(exponent_stream_t* stream) {
+    size_t pos = __atomic_load_n(&stream->segment_pos, __ATOMIC_RELAXED);
+    size_t count = __atomic_load_n(&stream->segment_count, __ATOMIC_RELAXED);
+    if (pos < count && !exponent_stream_at_end(stream))
+        return __atomic_load_n(&stream->segment[pos], __ATOMIC_RELAXED);
+    return __atomic_load_n(&stream->segment_start, __ATOMIC_RELAXED);
+}
+
+// Exponents per refill when the stream is around p
+static inline size_t work_queue_batch_size(unsigned long p) {
+    double cost = (double)p * p * log2((double)p + 2);
+    double batch = WORK_QUEUE_BATCH_COST / cost;
+    if (batch < 1)
+        return 1;
+    if (batch > WORK_QUEUE_MAX_BATCH)
+        return WORK_QUEUE_MAX_BATCH;
+    return (size_t)batch;
+}
+
+// Next exponent for worker id, or 0 when the whole range has been handed out
+static inline unsigned long work_queue_next(work_queue_t* queue, int id) {
+    work_deque_t* own = &queue->deques[id];
+    unsigned long p = work_deque_pop(own);
+
+    if (p == 0) {
+        unsigned long batch[WORK_QUEUE_MAX_BATCH];
+        size_t wanted = work_queue_batch_size(work_queue_stream_position(queue->stream));
+        size_t count = exponent_stream_take(queue->stream, batch, wanted);
+
+        if (count > 0) {
+            // Largest at the top for thieves, smallest at the bottom for the owner
+            p = batch[0];
+            for (size_t i = count; i > 1; i--)
+                work_deque_push(own, batch[i - 1]);
+        } else {
+            for (int i = 1; i < queue->count && p == 0; i++)
+                p = work_deque_steal(&queue->deques[(id + i) % queue->count]);
+        }
+    }
+
+    __atomic_store_n(&own->current, p, __ATOMIC_RELAXED);
+    return p;
+}
+
+// Smallest exponent that is still being tested or waiting to be handed out, for status lines
+static inline unsigned long work_queue_frontier(work_queue_t* queue) {
+    unsigned long frontier = work_queue_stream_position(queue->stream);
+    for (int i = 0; i < queue->count; i++) {
+        unsigned long p = __atomic_load_n(&queue->deques[i].current, __ATOMIC_RELAXED);
+        if (p != 0 && p < frontier)
+            frontier = p;
+    }
+    return frontier;
+}
+
+// Turns for team tests. A worker holding an exponent big enough to share with a team waits
+// here until every other worker is waiting too or has run out of work, so the team has the
+// cores to itself; the waiting workers then lead their team tests one at a time.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int active;         // workers that haven't finished
+    int waiting;
+    int leading;        // a team test is running
+} work_gate_t;
+
+static inline void work_gate_init(work_gate_t* gate, int workers) {
+    pthread_mutex_init(&gate->lock, NULL);
+    pthread_cond_init(&gate->changed, NULL);
+    gate->active = workers;
+    gate->waiting = 0;
+    gate->leading = 0;
+}
+
+static inline void work_gate_clear(work_gate_t* gate) {
+    pthread_cond_destroy(&gate->changed);
+    pthread_mutex_destroy(&gate->lock);
+}
+
+// Block until the calling worker may lead a team test
+static inline void work_gate_enter(work_gate_t* gate) {
+    pthread_mutex_lock(&gate->lock);
+    gate->waiting++;
+    while (gate->leading || gate->waiting < gate->active)
+        pthread_cond_wait(&gate->changed, &gate->lock);
+    gate->waiting--;
+    gate->leading = 1;
+    pthread_mutex_unlock(&gate->lock);
+}
+
+// The team test is done; let the next waiter lead
+static inline void work_gate_leave(work_gate_t* gate) {
+    pthread_mutex_lock(&gate->lock);
+    gate->leading = 0;
+    pthread_cond_broadcast(&gate->changed);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+// The calling worker has stopped for good
+static inline void work_gate_retire(work_gate_t* gate) {
+    pthread_mutex_lock(&gate->lock);
+    gate->active--;
+    pthread_cond_broadcast(&gate->changed);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+#endif